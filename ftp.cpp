@@ -63,10 +63,15 @@
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QLocale>
 #include <QtCore/QMimeDatabase>
 #include <QtCore/QMimeType>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QStandardPaths>
 #include <QtNetwork/QHostAddress>
+#include <QtNetwork/QSslConfiguration>
 #include <QtNetwork/QTcpServer>
 #include <QtNetwork/QNetworkProxy>
 
@@ -74,9 +79,16 @@
 #include <kio/slaveconfig.h>
 #include <kremoteencoding.h>
 #include <kde_file.h>
+#include <kconfig.h>
 #include <kconfiggroup.h>
 #include <kmessagebox.h>
 
+#include <sys/resource.h>
+#ifdef Q_OS_LINUX
+#include <poll.h>
+#include <sys/sendfile.h>
+#endif
+
 #ifdef HAVE_STRTOLL
   #define charToLongLong(a) strtoll(a, 0, 10)
 #else
@@ -138,10 +150,129 @@ namespace KIO {
       }
       return 0;
    }
+
+    static
+    /**
+     * Same as WriteToFile() but writes at @p offset without using or moving
+     * the file position, so several threads can fill one file.
+     */
+   int PWriteToFile(int fd, const char *buf, size_t len, KIO::fileoffset_t offset)
+   {
+      while (len > 0)
+      {
+         ssize_t written = pwrite(fd, buf, len, offset);
+         if (written >= 0)
+         {   buf += written;
+             len -= written;
+             offset += written;
+             continue;
+         }
+         switch(errno)
+         {   case EINTR:   continue;
+             case ENOSPC:  return ERR_DISK_FULL;
+             default:      return ERR_COULD_NOT_WRITE;
+         }
+      }
+      return 0;
+   }
 }
 
 KIO::filesize_t Ftp::UnknownSize = (KIO::filesize_t)-1;
 
+/**
+ * Reads the port number from the reply to PASV. The usual answer is
+ * '227 Entering Passive Mode. (160,39,200,55,6,245)' but anonftpd gives
+ * '227 =160,39,200,55,6,245'. @p text is the reply without its code.
+ *
+ * The host part is ignored on purpose for two reasons
+ * a) it might be wrong anyway
+ * b) it would make us being suceptible to a port scanning attack
+ */
+static bool ftpParsePasvReply(const char* text, quint16& port)
+{
+  int i[6];
+  const char *start = strchr(text, '(');
+  if ( !start )
+    start = strchr(text, '=');
+  if ( !start ||
+       ( sscanf(start, "(%d,%d,%d,%d,%d,%d)",&i[0], &i[1], &i[2], &i[3], &i[4], &i[5]) != 6 &&
+         sscanf(start, "=%d,%d,%d,%d,%d,%d", &i[0], &i[1], &i[2], &i[3], &i[4], &i[5]) != 6 ) )
+  {
+    qCCritical(KIO_FTPS) << "parsing IP and port numbers failed. String parsed: " << start;
+    return false;
+  }
+  port = i[4] << 8 | i[5];
+  return true;
+}
+
+/**
+ * Reads the port number from the reply to EPSV, e.g.
+ * '229 Entering Extended Passive Mode (|||6446|)'
+ */
+static bool ftpParseEpsvReply(const char* text, quint16& port)
+{
+  int portnum;
+  const char *start = strchr(text, '|');
+  if ( !start || sscanf(start, "|||%d|", &portnum) != 1)
+    return false;
+  port = portnum;
+  return true;
+}
+
+/**
+ * CPU time used by this process in milliseconds, to see what a transfer
+ * costs per byte
+ */
+static qint64 cpuTimeMs()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return qint64(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+/**
+ * Logs the CPU time used for @p bytes of a transfer started at @p startMs
+ */
+static void logCpuPerGiB(const char* what, KIO::filesize_t bytes, qint64 startMs, bool zeroCopy)
+{
+  if (bytes == 0)
+    return;
+  double ms = cpuTimeMs() - startMs;
+  qCDebug(KIO_FTPS) << what << ": " << bytes << " bytes, CPU " << ms * (1 << 30) / bytes
+                    << " ms per GiB" << (zeroCopy ? " (zero-copy)" : "");
+}
+
+/**
+ * Plain bytes a "MODE Z" transfer goes through before Ftp::ftpKeepCompressing()
+ * decides whether compression pays for it
+ */
+static const qint64 compressionProbeSize = 4 * 1024 * 1024;
+
+/**
+ * Counts the calls a transfer makes on the data connection, the local file
+ * and the KIO connection to the application
+ */
+struct TransferCalls
+{
+  TransferCalls() : reads(0), writes(0), waits(0), ipc(0) {}
+
+  void log(const char* what, KIO::filesize_t bytes) const
+  {
+    if (bytes == 0)
+      return;
+    double mib = double(bytes) / (1024 * 1024);
+    qCDebug(KIO_FTPS) << what << ": per MiB " << reads / mib << " reads, " << writes / mib
+                      << " writes, " << waits / mib << " waits, " << ipc / mib << " IPC calls";
+  }
+
+  qint64 reads;
+  qint64 writes;
+  qint64 waits;
+  qint64 ipc;
+};
+
 using namespace KIO;
 
 extern "C" int Q_DECL_EXPORT kdemain( int argc, char **argv )
@@ -175,6 +306,21 @@ Ftp::Ftp( const QByteArray &pool, const QByteArray &app )
 {
   // init the socket data
   m_data = m_control = NULL;
+  m_zData = NULL;
+  m_bPipelineBroken = false;
+  m_bMlsd = false;
+  m_bNlst = false;
+  m_bMlstFactsReduced = false;
+  m_bRestRefused = false;
+  m_iDirPos = 0;
+  m_iListYear = 0;
+  m_iListOffsetHour = -1;
+  m_bListAscii = false;
+  m_iListCacheHits = m_iListCacheMisses = 0;
+  m_iListBatchLimit = 64;
+  m_pStreamEntries = NULL;
+  m_dataConnMode = dataConnUnknown;
+  m_statProbe = statProbeUnknown;
   ftpCloseControlConnection();
 
   // init other members
@@ -196,6 +342,8 @@ void Ftp::ftpCloseDataConnection()
 {
   delete m_data;
   m_data = NULL;
+  delete m_zData;
+  m_zData = NULL;
 }
 
 /**
@@ -205,12 +353,19 @@ void Ftp::ftpCloseDataConnection()
 void Ftp::ftpCloseControlConnection()
 {
   m_extControl = 0;
+  m_dataProtection = protUnknown;
+  m_iMinRtt = 0;
+  m_bMlstFactsReduced = false;  // OPTS MLST is per session
   delete m_control;
   m_control = NULL;
+  m_cmdQueue.clear();
+  m_queueResponses.clear();
   m_cDataMode = 0;
+  m_bModeZ = false;
   m_bLoggedOn = false;    // logon needs control connction
   m_bTextMode = false;
   m_bBusy = false;
+  m_bAbortReplyPending = false;
 }
 
 /**
@@ -226,12 +381,17 @@ const char* Ftp::ftpResponse(int iOffset)
   if(iOffset < 0)
   {
     int  iMore = 0;
+    int  iLine = 0;
     m_iRespCode = 0;
+    m_responseLines.clear();
 
     // If the server sends multiline responses "nnn-text" we loop here until
     // a final "nnn text" line is reached. Only data from the final line will
-    // be stored. Some servers (OpenBSD) send a single "nnn-" followed by
-    // optional lines that start with a space and a final "nnn text" line.
+    // be stored, the others go to m_responseLines. Some servers (OpenBSD)
+    // send a single "nnn-" followed by optional lines that start with a
+    // space and a final "nnn text" line.
+    // While m_pStreamEntries is set the text lines are a listing, they go
+    // to ftpStreamListingLine() as they come in instead.
     do {
       while (!m_control->canReadLine() && m_control->waitForReadyRead()) {}
       m_lastControlLine = m_control->readLine();
@@ -240,25 +400,42 @@ const char* Ftp::ftpResponse(int iOffset)
       int iCode  = atoi(pTxt);
       if(iCode > 0) m_iRespCode = iCode;
 
-      // ignore lines starting with a space in multiline response
-      if(iMore != 0 && pTxt[0] == 32)
-        ;
+      // in a multiline response only "nnn " with the same code ends it, all
+      // other lines are text, e.g. the listing of STAT <path>
+      if(iMore != 0)
+      {
+        if(nBytes == 0)           // timeout or connection lost
+          m_iRespCode = iMore = 0;
+        else if(iCode == iMore && nBytes >= 4 && pTxt[3] != '-')
+          iMore = 0;
+      }
       // otherwise the line should start with "nnn-" or "nnn "
       else if(nBytes < 4 || iCode < 100)
         iMore = 0;
       // we got a valid line, now check for multiline responses ...
-      else if(iMore == 0 && pTxt[3] == '-')
+      else if(pTxt[3] == '-')
         iMore = iCode;
-      // "nnn " ends multiline mode ...
-      else if(iMore != 0 && (iMore != iCode || pTxt[3] != '-'))
-        iMore = 0;
 
-      if(iMore != 0)
+      if(iMore != 0 && m_pStreamEntries != NULL && iLine > 0)
+        ftpStreamListingLine(m_lastControlLine, iMore);
+      else if(iMore != 0)
+      {
          qCDebug(KIO_FTPS) << "    > " << pTxt;
+         m_responseLines.append(m_lastControlLine);
+      }
+      ++iLine;
     } while(iMore != 0);
     qCDebug(KIO_FTPS) << "resp> " << pTxt;
 
     m_iRespType = (m_iRespCode > 0) ? m_iRespCode / 100 : 0;
+
+    // a late second reply to ABOR comes before any other, see ftpAbortTransfer()
+    if(m_bAbortReplyPending)
+    {
+      m_bAbortReplyPending = false;
+      if(m_iRespCode == 225 || m_iRespCode == 226)
+        return ftpResponse(iOffset);
+    }
   }
 
   // return text with offset ...
@@ -276,7 +453,7 @@ void Ftp::closeConnection()
   if(m_bBusy)              // ftpCloseCommand not called
   {
     qCWarning(KIO_FTPS) << "Ftp::closeConnection Abandoned data stream";
-    ftpCloseDataConnection();
+    ftpAbortTransfer();
   }
 
   if(m_bLoggedOn)           // send quit
@@ -300,7 +477,18 @@ void Ftp::setHost( const QString& _host, quint16 _port, const QString& _user,
 
   if ( m_host != _host || m_port != _port ||
        m_user != _user || m_pass != _pass )
+  {
     closeConnection();
+    m_listCache.clear();        // another user may see other files
+    m_listStrings.clear();
+    m_largeDirs.clear();
+  }
+  if ( m_host != _host || m_port != _port )
+  { // what we learned is about the old server
+    m_dataConnMode = dataConnUnknown;
+    m_statProbe = statProbeUnknown;
+    m_noCompress.clear();
+  }
 
   m_host = _host;
   m_port = _port;
@@ -341,10 +529,18 @@ bool Ftp::ftpOpenConnection (LoginMode loginMode)
   QString host = m_bUseProxy ? m_proxyURL.host() : m_host;
   int port = m_bUseProxy ? m_proxyURL.port() : m_port;
 
+  ftpLoadHostCache();
   if (!ftpOpenControlConnection(host, port) )
     return false;          // error emitted by ftpOpenControlConnection
   infoMessage( QObject::tr("Connected to host %1").arg(m_host) );
 
+  // what earlier sessions found out about the server
+  m_extControl |= m_hostCache.extControl;
+  if ( m_dataConnMode == dataConnUnknown )
+    m_dataConnMode = m_hostCache.dataConnMode;
+  if ( m_statProbe == statProbeUnknown )
+    m_statProbe = m_hostCache.statProbe;
+
   if(loginMode != loginDefered)
   {
     m_bLoggedOn = ftpLogin();
@@ -423,6 +619,14 @@ bool Ftp::ftpOpenControlConnection( const QString &host, int port, bool ignoreSs
     // ignore the errors during handshakes. 
 
     if (ignoreSslErrors) m_control->ignoreSslErrors();
+
+    // Keep the TLS session around, the data connections resume it. A
+    // session from the host cache saves the full handshake right here.
+    QSslConfiguration sslConfig = m_control->sslConfiguration();
+    sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if (!m_hostCache.sessionTicket.isEmpty())
+      sslConfig.setSessionTicket(m_hostCache.sessionTicket);
+    m_control->setSslConfiguration(sslConfig);
     m_control->startClientEncryption();
 
     if (!m_control->waitForEncrypted(connectTimeout() * 1000)) 
@@ -585,6 +789,8 @@ bool Ftp::ftpLogin()
 
     if ( loggedIn )
     {
+      m_loginUser = user;
+      m_loginPass = pass;
       // Do not cache the default login!!
       if( user != FTP_LOGIN && pass != FTP_PASSWD )
         cacheAuthentication( info );
@@ -597,11 +803,42 @@ bool Ftp::ftpLogin()
   qCDebug(KIO_FTPS) << "Login OK";
   infoMessage( QObject::tr("Login OK") );
 
+  // Data channel protection, SYST and PWD don't depend on each other, send
+  // them in one go. An auto login macro may change the directory, PWD must
+  // follow it in that case. What the host cache knows is not asked again.
+  // If the protection level is known too, PBSZ/PROT stay queued and go out
+  // with the first real command, see ftpRecordResponse().
+  bool bAutoLoginMacro = config()->readEntry ("EnableAutoLoginMacro", false);
+  bool bCachedSyst = !m_hostCache.syst.isEmpty();
+  bool bCachedPwd = !bAutoLoginMacro && !m_hostCache.initialPath.isEmpty();
+  ftpQueueDataEncryption();
+  if ( !bCachedSyst )
+    ftpQueueCmd("SYST");
+  if ( !(m_extControl & featKnown) )
+    ftpQueueCmd("FEAT");
+  if ( !bAutoLoginMacro && !bCachedPwd )
+    ftpQueueCmd("PWD");
+  if ( m_hostCache.dataProtection != protUnknown && bCachedSyst && (m_extControl & featKnown) &&
+       (bCachedPwd || bAutoLoginMacro) )
+    m_dataProtection = m_hostCache.dataProtection;
+  else
+  {
+    ftpFlushCmdQueue();
+    requestDataEncryption();
+  }
+
+  if ( bCachedSyst )
+    m_syst = m_hostCache.syst;
+  else if( ftpUseResponse("SYST") && (m_iRespType == 2) )
+    m_syst = ftpResponse(0);
+  else
+    m_syst.clear();
+
   // Okay, we're logged in. If this is IIS 4, switch dir listing style to Unix:
   // Thanks to jk@soegaard.net (Jens Kristian Sgaard) for this hint
-  if( ftpSendCmd("SYST") && (m_iRespType == 2) )
+  if( !m_syst.isEmpty() )
   {
-    if( !strncmp( ftpResponse(0), "215 Windows_NT", 14 ) ) // should do for any version
+    if( m_syst.startsWith( "215 Windows_NT" ) ) // should do for any version
     {
       ftpSendCmd( "site dirstyle" );
       // Check if it was already in Unix style
@@ -616,12 +853,22 @@ bool Ftp::ftpLogin()
   else
     qCWarning(KIO_FTPS) << "SYST failed";
 
-  if ( config()->readEntry ("EnableAutoLoginMacro", false) )
+  if ( bAutoLoginMacro )
     ftpAutoLoginMacro ();
 
   // Get the current working directory
+  if ( bCachedPwd )
+  {
+    m_initialPath = m_hostCache.initialPath;
+    qCDebug(KIO_FTPS) << "Initial path from host cache: " << m_initialPath;
+    m_currentPath = m_initialPath;
+    ftpSaveHostCache();
+    return true;
+  }
+
   qCDebug(KIO_FTPS) << "Searching for pwd";
-  if( !ftpSendCmd("PWD") || (m_iRespType != 2) )
+  bool bPwd = bAutoLoginMacro ? ftpSendCmd("PWD") : ftpUseResponse("PWD");
+  if( !bPwd || (m_iRespType != 2) )
   {
     qCDebug(KIO_FTPS) << "Couldn't issue pwd command";
     error( ERR_COULD_NOT_LOGIN, QObject::tr("Could not login to %1.").arg(m_host) ); // or anything better ?
@@ -638,9 +885,111 @@ bool Ftp::ftpLogin()
     qCDebug(KIO_FTPS) << "Initial path set to: " << m_initialPath;
     m_currentPath = m_initialPath;
   }
+  ftpSaveHostCache();
   return true;
 }
 
+QString Ftp::ftpHostCacheFile() const
+{
+  // what the cache holds is about the server the control connection goes
+  // to, that is the proxy if there is one
+  QString host = m_bUseProxy ? m_proxyURL.host() : m_host;
+  int port = m_bUseProxy ? m_proxyURL.port() : m_port;
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+         QString::fromLatin1("/hosts/%1_%2").arg(host).arg(port > 0 ? port : DEFAULT_FTP_PORT);
+}
+
+QString Ftp::ftpHostCacheGroup() const
+{
+  // behind a proxy one file serves all the servers it leads to
+  QString group = m_user.isEmpty() ? QString(FTP_LOGIN) : m_user;
+  if ( m_bUseProxy )
+    group += QString::fromLatin1("@%1:%2").arg(m_host).arg(m_port > 0 ? m_port : DEFAULT_FTP_PORT);
+  return group;
+}
+
+void Ftp::ftpLoadHostCache()
+{
+  // The session ticket only lives as long as the slave, a ticket on disk
+  // would be as good as a key to the session. It belongs to the endpoint
+  // it came from.
+  if ( m_hostCache.ticketFile != ftpHostCacheFile() )
+    m_hostCache.sessionTicket.clear();
+  m_hostCache.extControl = 0;
+  m_hostCache.syst.clear();
+  m_hostCache.initialPath.clear();
+  m_hostCache.dataConnMode = dataConnUnknown;
+  m_hostCache.dataProtection = protUnknown;
+  m_hostCache.statProbe = statProbeUnknown;
+
+  qint64 ttl = config()->readEntry("CapabilityCacheTTL", 3600);
+  if ( ttl <= 0 || m_host.isEmpty() )
+    return;
+
+  KConfig cache( ftpHostCacheFile(), KConfig::SimpleConfig );
+  KConfigGroup group = cache.group( ftpHostCacheGroup() );
+  qint64 age = QDateTime::currentMSecsSinceEpoch() / 1000 - group.readEntry("Timestamp", qint64(0));
+  if ( age < 0 || age > ttl )
+    return;
+
+  m_hostCache.extControl = group.readEntry("ExtControl", 0);
+  m_hostCache.syst = group.readEntry("Syst", QByteArray());
+  m_hostCache.initialPath = group.readEntry("InitialPath", QString());
+  m_hostCache.dataConnMode = group.readEntry("DataConnMode", int(dataConnUnknown));
+  m_hostCache.dataProtection = group.readEntry("DataProtection", int(protUnknown));
+  m_hostCache.statProbe = group.readEntry("StatProbe", int(statProbeUnknown));
+  qCDebug(KIO_FTPS) << "Using host cache, age" << age << "s";
+}
+
+void Ftp::ftpSaveHostCache()
+{
+  if ( config()->readEntry("CapabilityCacheTTL", 3600) <= 0 || !m_control )
+    return;
+
+  QString sFile = ftpHostCacheFile();
+  m_hostCache.sessionTicket = m_control->sslConfiguration().sessionTicket();
+  m_hostCache.ticketFile = sFile;
+
+  HostCache cached = m_hostCache;
+  m_hostCache.extControl = m_extControl & (epsvUnknown | epsvAllUnknown | eprtUnknown |
+                                           pasvUnknown | chmodUnknown | featKnown | mlstSupported |
+                                           modeZSupported | hashCrc32 | hashSha256 |
+                                           xcrcSupported | xsha256Supported);
+  m_hostCache.syst = m_syst;
+  if ( !config()->readEntry ("EnableAutoLoginMacro", false) )
+    m_hostCache.initialPath = m_initialPath;
+  m_hostCache.dataConnMode = m_dataConnMode;
+  m_hostCache.dataProtection = m_dataProtection;
+  m_hostCache.statProbe = m_statProbe;
+
+  // the file is written again only once something changed or it expired,
+  // see ftpLoadHostCache()
+  if ( m_hostCache.extControl == cached.extControl && m_hostCache.syst == cached.syst &&
+       m_hostCache.initialPath == cached.initialPath && m_hostCache.dataConnMode == cached.dataConnMode &&
+       m_hostCache.dataProtection == cached.dataProtection && m_hostCache.statProbe == cached.statProbe )
+    return;
+
+  QDir().mkpath( sFile.left( sFile.lastIndexOf('/') ) );
+  // nobody else needs to know where the user goes
+  mode_t oldMask = ::umask( 077 );
+  {
+    KConfig cache( sFile, KConfig::SimpleConfig );
+    KConfigGroup group = cache.group( ftpHostCacheGroup() );
+    group.writeEntry( "Timestamp", QDateTime::currentMSecsSinceEpoch() / 1000 );
+    group.deleteEntry( "SessionTicket" );   // written by older versions
+    group.writeEntry( "ExtControl", m_hostCache.extControl );
+    group.writeEntry( "Syst", m_hostCache.syst );
+    group.writeEntry( "InitialPath", m_hostCache.initialPath );
+    group.writeEntry( "DataConnMode", m_hostCache.dataConnMode );
+    group.writeEntry( "DataProtection", m_hostCache.dataProtection );
+    group.writeEntry( "StatProbe", m_hostCache.statProbe );
+    cache.sync();
+  }
+  ::umask( oldMask );
+  // a file of an older version may still have wider permissions
+  QFile::setPermissions( sFile, QFile::ReadOwner | QFile::WriteOwner );
+}
+
 void Ftp::ftpAutoLoginMacro ()
 {
   QString macro = metaData( "autoLoginMacro" );
@@ -693,24 +1042,78 @@ bool Ftp::ftpSendCmd( const QByteArray& cmd, int maxretries )
     return false;
   }
 
+  // Queued commands go out in front of this one. If the server can't
+  // handle that we fall back to sending them one at a time.
+  const QList<QByteArray> pending = m_cmdQueue;
+  QList<QByteArray> queue = m_cmdQueue;
+  m_cmdQueue.clear();
+  if ( !queue.isEmpty() &&
+       (m_bPipelineBroken || config()->readEntry("DisablePipelining", false)) )
+  {
+    Q_FOREACH( const QByteArray& queued, queue )
+    {
+      if( !ftpSendCmd( queued, 0 ) )
+        m_iRespType = m_iRespCode = 0;
+      ftpRecordResponse( queued );
+    }
+    queue.clear();
+  }
+
   // Don't print out the password...
   bool isPassCmd = (cmd.left(4).toLower() == "pass");
+  Q_FOREACH( const QByteArray& queued, queue )
+    qCDebug(KIO_FTPS) << "send> " << queued.data() << " (pipelined)";
   if ( !isPassCmd )
     qCDebug(KIO_FTPS) << "send> " << cmd.data();
   else
     qCDebug(KIO_FTPS) << "send> pass [protected]";
 
   // Send the message...
-  QByteArray buf = cmd;
+  QByteArray buf;
+  Q_FOREACH( const QByteArray& queued, queue )
+  {
+    buf += queued;
+    buf += "\r\n";
+  }
+  buf += cmd;
   buf += "\r\n";      // Yes, must use CR/LF - see http://cr.yp.to/ftp/request.html
+  QElapsedTimer rttTimer;
+  rttTimer.start();
   int num = m_control->write(buf);
   while (m_control->bytesToWrite() && m_control->waitForBytesWritten()) {}
 
   // If we were able to successfully send the command, then we will
   // attempt to read the response. Otherwise, take action to re-attempt
   // the login based on the maximum number of retires specified...
-  if( num > 0 )
+  bool bGotResponses = (num > 0);
+  Q_FOREACH( const QByteArray& queued, queue )
+  {
+    if( bGotResponses )
+    {
+      ftpResponse(-1);
+      if( m_iRespType <= 0 )
+      {
+        // The server did not answer all of the pipelined commands, the
+        // rest of this exchange is lost. Don't pipeline any more.
+        qCWarning(KIO_FTPS) << "No response to pipelined command" << queued.data()
+                            << "- disabling pipelining";
+        m_bPipelineBroken = true;
+        bGotResponses = false;
+      }
+    }
+    else
+      m_iRespType = m_iRespCode = 0;
+    ftpRecordResponse( queued );
+  }
+
+  if( bGotResponses )
+  {
     ftpResponse(-1);
+    // the quickest answer tells the round trip time best
+    qint64 rtt = rttTimer.nsecsElapsed() / 1000;
+    if( queue.isEmpty() && m_iRespType > 0 && (m_iMinRtt == 0 || rtt < m_iMinRtt) )
+      m_iMinRtt = rtt;
+  }
   else
   {
     m_iRespType = m_iRespCode = 0;
@@ -761,6 +1164,15 @@ bool Ftp::ftpSendCmd( const QByteArray& cmd, int maxretries )
 
         qCDebug(KIO_FTPS) << "Logged back in, re-issuing command";
 
+        // The new session starts with no TYPE, MODE or PROT of ours, what
+        // was queued in front of the command has to go again. ftpLogin()
+        // took care of PBSZ/PROT.
+        m_cDataMode = 0;
+        m_bModeZ = false;
+        Q_FOREACH( const QByteArray& queued, pending )
+          if ( !queued.startsWith("PBSZ ") && !queued.startsWith("PROT ") )
+            ftpQueueCmd( queued );
+
         // If we were able to login, resend the command...
         if (maxretries)
           maxretries--;
@@ -773,6 +1185,123 @@ bool Ftp::ftpSendCmd( const QByteArray& cmd, int maxretries )
   return true;
 }
 
+void Ftp::ftpQueueCmd( const QByteArray& cmd )
+{
+  assert(cmd.indexOf('\r') == -1 && cmd.indexOf('\n') == -1);
+  if ( m_cmdQueue.isEmpty() )     // a new batch starts
+    m_queueResponses.clear();
+  m_cmdQueue.append( cmd );
+}
+
+bool Ftp::ftpFlushCmdQueue()
+{
+  if ( m_cmdQueue.isEmpty() )
+    return true;
+
+  // the last command is sent by ftpSendCmd, which takes the others along
+  QByteArray cmd = m_cmdQueue.takeLast();
+  bool bResult = ftpSendCmd( cmd );
+  ftpRecordResponse( cmd );
+  return bResult;
+}
+
+/**
+ * Appends the current response to m_queueResponses. Keeps the session
+ * state in sync that would otherwise be maintained by the caller of
+ * ftpSendCmd().
+ */
+void Ftp::ftpRecordResponse( const QByteArray& cmd )
+{
+  FtpResponse resp;
+  resp.cmd = cmd;
+  resp.code = m_iRespCode;
+  resp.line = m_lastControlLine;
+  m_queueResponses.append( resp );
+
+  // see ftpDataMode()
+  if ( m_iRespType == 2 && cmd.startsWith("TYPE ") && cmd.size() > 5 )
+    m_cDataMode = cmd[5];
+  if ( m_iRespType > 0 && cmd.startsWith("MODE ") && cmd.size() > 5 )
+  {
+    if ( m_iRespType == 2 )
+      m_bModeZ = (cmd[5] == 'Z');
+    else if ( cmd[5] == 'Z' )
+      m_extControl &= ~modeZSupported;     // FEAT promised more than there is
+  }
+  // see requestDataEncryption(), ftpLogin() may leave PROT in the queue.
+  // After a refusal ftpOpenCommand() negotiates again and sends PROT C.
+  if ( m_iRespType > 0 && cmd == "PROT P" )
+    m_dataProtection = (m_iRespType == 2) ? protPrivate : protUnknown;
+  if ( m_iRespType > 0 && cmd == "FEAT" )
+    ftpParseFeatures();
+  // see ftpOpenDir(), a refused OPTS leaves the facts as they were
+  if ( m_iRespType == 2 && cmd.startsWith("OPTS MLST ") )
+    m_bMlstFactsReduced = (cmd == "OPTS MLST type;");
+}
+
+void Ftp::ftpParseFeatures()
+{
+  // 211-Features:
+  //  MLST type*;size*;modify*;perm*;unique*;
+  //  MODE Z
+  //  HASH SHA-1;SHA-256*;CRC32
+  //  SIZE
+  // 211 End
+  // Servers without FEAT have none of the features we ask for.
+  m_extControl |= featKnown;
+  if ( m_iRespType != 2 )
+    return;
+  Q_FOREACH( const QByteArray& line, m_responseLines )
+  {
+    QByteArray feature = line.trimmed().toUpper();
+    if ( feature == "MLST" || feature.startsWith("MLST ") )
+    {
+      m_extControl |= mlstSupported;
+      // the facts marked with '*' are the ones the server sends by default
+      m_mlstFacts.clear();
+      Q_FOREACH( const QByteArray& fact, line.trimmed().mid(5).split(';') )
+        if ( fact.endsWith('*') )
+          m_mlstFacts += fact.left( fact.size() - 1 ) + ';';
+    }
+    else if ( feature == "MODE Z" )
+      m_extControl |= modeZSupported;
+    else if ( feature.startsWith("HASH ") )
+    {
+      Q_FOREACH( QByteArray algorithm, feature.mid(5).split(';') )
+      {
+        if ( algorithm.endsWith('*') )
+          algorithm.chop(1);
+        if ( algorithm == "CRC32" )
+          m_extControl |= hashCrc32;
+        else if ( algorithm == "SHA-256" )
+          m_extControl |= hashSha256;
+      }
+    }
+    else if ( feature == "XCRC" )
+      m_extControl |= xcrcSupported;
+    else if ( feature == "XSHA256" )
+      m_extControl |= xsha256Supported;
+  }
+  qCDebug(KIO_FTPS) << "FEAT: MLST" << ((m_extControl & mlstSupported) ? "supported" : "not supported")
+                    << ", MODE Z" << ((m_extControl & modeZSupported) ? "supported" : "not supported");
+}
+
+bool Ftp::ftpUseResponse( const QByteArray& cmd )
+{
+  Q_FOREACH( const FtpResponse& resp, m_queueResponses )
+  {
+    if ( resp.cmd == cmd || resp.cmd.startsWith(cmd + ' ') )
+    {
+      m_lastControlLine = resp.line;
+      m_iRespCode = resp.code;
+      m_iRespType = (m_iRespCode > 0) ? m_iRespCode / 100 : 0;
+      return m_iRespType > 0;
+    }
+  }
+  m_iRespType = m_iRespCode = 0;
+  return false;
+}
+
 /*
  * ftpOpenPASVDataConnection - set up data connection, using PASV mode
  *
@@ -808,26 +1337,11 @@ int Ftp::ftpOpenPASVDataConnection()
     return ERR_INTERNAL;
   }
 
-  // The usual answer is '227 Entering Passive Mode. (160,39,200,55,6,245)'
-  // but anonftpd gives '227 =160,39,200,55,6,245'
-  int i[6];
-  const char *start = strchr(ftpResponse(3), '(');
-  if ( !start )
-    start = strchr(ftpResponse(3), '=');
-  if ( !start ||
-       ( sscanf(start, "(%d,%d,%d,%d,%d,%d)",&i[0], &i[1], &i[2], &i[3], &i[4], &i[5]) != 6 &&
-         sscanf(start, "=%d,%d,%d,%d,%d,%d", &i[0], &i[1], &i[2], &i[3], &i[4], &i[5]) != 6 ) )
-  {
-    qCCritical(KIO_FTPS) << "parsing IP and port numbers failed. String parsed: " << start;
+  quint16 port;
+  if ( !ftpParsePasvReply(ftpResponse(3), port) )
     return ERR_INTERNAL;
-  }
-
-  // we ignore the host part on purpose for two reasons
-  // a) it might be wrong anyway
-  // b) it would make us being suceptible to a port scanning attack
 
   // now connect the data socket ...
-  quint16 port = i[4] << 8 | i[5];
   qCDebug(KIO_FTPS) << "Connecting to " << addr.toString() << " port " << port;
 
   m_data = new QSslSocket();
@@ -849,7 +1363,7 @@ int Ftp::ftpOpenEPSVDataConnection()
   assert(m_data == NULL);       // ... but no data connection
 
   QHostAddress address = m_control->peerAddress();
-  int portnum;
+  quint16 portnum;
 
   if (m_extControl & epsvUnknown)
     return ERR_INTERNAL;
@@ -866,8 +1380,7 @@ int Ftp::ftpOpenEPSVDataConnection()
     return ERR_INTERNAL;
   }
 
-  const char *start = strchr(ftpResponse(3), '|');
-  if ( !start || sscanf(start, "|||%d|", &portnum) != 1)
+  if ( !ftpParseEpsvReply(ftpResponse(3), portnum) )
     return ERR_INTERNAL;
 
   m_data = new QSslSocket();
@@ -883,6 +1396,18 @@ int Ftp::encryptDataChannel()
 {
   if (m_bIgnoreSslErrors) m_data->ignoreSslErrors();
 
+  // Offer the control connection's session to the server, this saves a
+  // full handshake. Some servers (vsftpd with require_ssl_reuse, ProFTPD
+  // unless "TLSOptions NoSessionReuseRequired" is set) even insist on it.
+  QByteArray session = m_control->sslConfiguration().sessionTicket();
+  if (m_bPasv && !session.isEmpty())
+  {
+    QSslConfiguration sslConfig = m_data->sslConfiguration();
+    sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    sslConfig.setSessionTicket(session);
+    m_data->setSslConfiguration(sslConfig);
+  }
+
   if (m_bPasv) m_data->startClientEncryption();
   else m_data->startServerEncryption();
 
@@ -891,24 +1416,38 @@ int Ftp::encryptDataChannel()
   return 0;
 }
 
-bool Ftp::requestDataEncryption()
+void Ftp::ftpQueueDataEncryption()
 {
-  // initate tls transfer for data chanel on the control channel 
-
-  bool pbszSucc = (ftpSendCmd("PBSZ 0") && (m_iRespType == 2));
-  if (!pbszSucc) return false;
-    
+  // initate tls transfer for data chanel on the control channel
+  ftpQueueCmd("PBSZ 0");
   // try protected data transfer first
+  ftpQueueCmd("PROT P");
+}
+
+bool Ftp::requestDataEncryption()
+{
+  bool pbszSucc = (ftpUseResponse("PBSZ") && (m_iRespType == 2));
+  int pbszCode = m_iRespCode;
+  bool protpSucc = (ftpUseResponse("PROT") && (m_iRespType == 2));
+  if (pbszCode == 0 || m_iRespCode == 0)
+  {
+    // no answer at all (connection trouble), try again next time
+    m_dataProtection = protUnknown;
+    return false;
+  }
 
-  bool protpSucc = (ftpSendCmd("PROT P") && (m_iRespType == 2));
-  if (!protpSucc)
+  if (!pbszSucc || !protpSucc)
   {
     // Set the data channel to clear (should not be necessary, just in case).
 
     ftpSendCmd("PROT C");
+    m_dataProtection = protClear;
+    qCDebug(KIO_FTPS) << "data channel protection: clear";
     return false;
   }
-  
+
+  m_dataProtection = protPrivate;
+  qCDebug(KIO_FTPS) << "data channel protection: private";
   return true;
 }
 
@@ -932,29 +1471,37 @@ int Ftp::ftpOpenDataConnection()
 
   int  iErrCode = 0;
   int  iErrCodePASV = 0;  // Remember error code from PASV
+  int  iLastMode = m_dataConnMode;
 
   // First try passive (EPSV & PASV) modes
   if ( !config()->readEntry("DisablePassiveMode", false) )
   {
-    iErrCode = ftpOpenPASVDataConnection();
-    if(iErrCode == 0)
+    bool bEpsv = !config()->readEntry("DisableEPSV", false);
+
+    // Skip PASV if only EPSV worked last time
+    if ( !(bEpsv && iLastMode == dataConnEpsv) )
     {
-      // success
-      requestDataEncryption();
-      return 0; 
+      iErrCode = ftpOpenPASVDataConnection();
+      if(iErrCode == 0)
+        return ftpDataConnectionOpened(dataConnPasv); // success
+      iErrCodePASV = iErrCode;
+      ftpCloseDataConnection();
     }
-    iErrCodePASV = iErrCode;
-    ftpCloseDataConnection();
 
-    if ( !config()->readEntry("DisableEPSV", false) )
+    if ( bEpsv )
     {
       iErrCode = ftpOpenEPSVDataConnection();
       if(iErrCode == 0)
-      {
-	// success
-	requestDataEncryption();
-	return 0; 
-      }
+        return ftpDataConnectionOpened(dataConnEpsv); // success
+      ftpCloseDataConnection();
+    }
+
+    if ( bEpsv && iLastMode == dataConnEpsv )
+    {
+      iErrCode = ftpOpenPASVDataConnection();
+      if(iErrCode == 0)
+        return ftpDataConnectionOpened(dataConnPasv); // success
+      iErrCodePASV = iErrCode;
       ftpCloseDataConnection();
     }
 
@@ -966,19 +1513,30 @@ int Ftp::ftpOpenDataConnection()
 
   // fall back to port mode
   iErrCode = ftpOpenPortDataConnection();
-
-  if(iErrCode == 0) 
-  {
-    // success
-    requestDataEncryption();
-    return 0; 
-  }
+  if(iErrCode == 0)
+    return ftpDataConnectionOpened(dataConnPort); // success
 
   ftpCloseDataConnection();
   // prefer to return the error code from PASV if any, since that's what should have worked in the first place
   return iErrCodePASV ? iErrCodePASV : iErrCode;
 }
 
+/*
+ * ftpDataConnectionOpened - remember which kind of data connection works,
+ * the host cache is updated when this changes
+ *
+ * @return 0
+ */
+int Ftp::ftpDataConnectionOpened(int iMode)
+{
+  if ( m_dataConnMode != iMode )
+  {
+    m_dataConnMode = iMode;
+    ftpSaveHostCache();
+  }
+  return 0;
+}
+
 /*
  * ftpOpenPortDataConnection - set up data connection
  *
@@ -1042,22 +1600,36 @@ int Ftp::ftpOpenPortDataConnection()
 }
 
 bool Ftp::ftpOpenCommand( const char *_command, const QString & _path, char _mode,
-                          int errorcode, KIO::fileoffset_t _offset )
+                          int errorcode, KIO::fileoffset_t _offset, bool bCompress,
+                          bool bRestart )
 {
-  int errCode = 0;
-  if( !ftpDataMode(_mode) )
+  // TYPE and MODE need no answer before the data connection is set up, they
+  // go out together with PASV/EPSV/PORT. The data channel protection is
+  // normally known since ftpLogin().
+  bool bTypeQueued = ftpDataMode(_mode, true);
+  ftpTransferMode(bCompress);
+  bool bNegotiateProt = (m_dataProtection == protUnknown);
+  if ( bNegotiateProt )
+    ftpQueueDataEncryption();
+
+  int errCode = ftpOpenDataConnection();
+  if( errCode == 0 && bTypeQueued && ftpUseResponse("TYPE") && (m_iRespType != 2) )
     errCode = ERR_COULD_NOT_CONNECT;
-  else
-    errCode = ftpOpenDataConnection();
 
   if(errCode != 0)
   {
+    m_cmdQueue.clear();
+    ftpCloseDataConnection();
     error(errCode, m_host);
     return false;
   }
 
-  bool useDataEnc = requestDataEncryption();
+  // a PROT P that ftpLogin() left in the queue may have been refused just now
+  if ( bNegotiateProt || m_dataProtection == protUnknown )
+    requestDataEncryption();
+  bool useDataEnc = (m_dataProtection == protPrivate);
 
+  m_bRestRefused = false;
   if ( _offset > 0 ) {
     // send rest command if offset > 0, this applies to retr and stor commands
     char buf[100];
@@ -1066,6 +1638,12 @@ bool Ftp::ftpOpenCommand( const char *_command, const QString & _path, char _mod
        return false;
     if( m_iRespType != 3 )
     {
+      if ( bRestart )
+      { // the caller knows what else to do
+        m_bRestRefused = true;
+        ftpCloseDataConnection();
+        return false;
+      }
       error( ERR_CANNOT_RESUME, _path ); // should never happen
       return false;
     }
@@ -1090,7 +1668,7 @@ bool Ftp::ftpOpenCommand( const char *_command, const QString & _path, char _mod
   else
   {
     // Only now we know for sure that we can resume
-    if ( _offset > 0 && strcmp(_command, "retr") == 0 )
+    if ( _offset > 0 && !bRestart && strcmp(_command, "retr") == 0 )
       canResume();
 
     m_bBusy = true;              // cleared in ftpCloseCommand
@@ -1105,6 +1683,18 @@ bool Ftp::ftpOpenCommand( const char *_command, const QString & _path, char _mod
       }
     }
 
+    // the server may have stayed in MODE Z even if we didn't ask for it
+    if (m_bModeZ)
+    {
+      delete m_zData;
+      m_zData = new FtpZStream(strcmp(_command, "stor") == 0);
+      if (!m_zData->isValid())
+      {
+        error(ERR_OUT_OF_MEMORY, QString());
+        return false;
+      }
+    }
+
     return true;
   }
 
@@ -1122,6 +1712,18 @@ bool Ftp::ftpCloseCommand()
     delete  m_data;
     m_data = NULL;
   }
+  if(m_zData)
+  {
+    qCDebug(KIO_FTPS) << "MODE Z:" << m_zData->plainSize() << "bytes as" << m_zData->compressedSize()
+                      << "in" << m_zData->elapsedUs() / 1000 << "ms, zlib" << m_zData->zlibUs() / 1000 << "ms";
+    delete m_zData;
+    m_zData = NULL;
+  }
+  m_bMlsd = false;
+  m_bNlst = false;
+  m_dirBuffer.clear();
+  m_iDirPos = 0;
+  m_iListYear = 0;
   if(!m_bBusy)
     return true;
 
@@ -1136,11 +1738,52 @@ bool Ftp::ftpCloseCommand()
   return true;
 }
 
+bool Ftp::ftpAbortTransfer()
+{
+  if(!m_bBusy || !m_control)
+    return ftpCloseCommand();
+
+  // Drop the data connection first, a server blocked in send() notices that
+  // sooner than the ABOR. The Telnet IP and Synch of RFC 959 can't go
+  // through TLS, servers read ABOR from the control connection anyway.
+  QElapsedTimer timer;
+  timer.start();
+  m_bBusy = false;
+  ftpCloseCommand();
+
+  // A transfer that is over has its reply waiting already, one that
+  // isn't gets 426 and then the ABOR 226. A server may also send both
+  // replies for a transfer that ended just now, 226 and 225/226, or only
+  // one of them: a second one is left for ftpResponse() to skip rather
+  // than waited for.
+  bool bOk;
+  if(m_control->canReadLine() || m_control->waitForReadyRead(0))
+    bOk = ftpResponse(-1) && m_iRespType > 0;
+  else
+  {
+    bOk = ftpSendCmd("ABOR", 0) && m_iRespType > 0;
+    if(bOk && m_iRespType == 4)
+      bOk = ftpResponse(-1) && m_iRespType > 0;
+    else if(bOk && m_iRespCode == 226)
+      m_bAbortReplyPending = true;
+  }
+  if(!bOk)
+  {
+    qCWarning(KIO_FTPS) << "ftpAbortTransfer: no answer, dropping the connection";
+    ftpCloseControlConnection();
+    return false;
+  }
+  qCDebug(KIO_FTPS) << "ftpAbortTransfer: ready again after" << timer.elapsed() << "ms";
+  return true;
+}
+
 void Ftp::mkdir( const QUrl & url, int permissions )
 {
   if( !ftpOpenConnection(loginImplicit) )
         return;
 
+  ftpInvalidateListing( url.path(), false );
+
   QString path = remoteEncoding()->encode(url);
   QByteArray buf = "mkd ";
   buf += remoteEncoding()->encode(path);
@@ -1189,6 +1832,9 @@ bool Ftp::ftpRename( const QString & src, const QString & dst, KIO::JobFlags )
   // TODO honor overwrite
   assert( m_bLoggedOn );
 
+  ftpInvalidateListing( src, true );
+  ftpInvalidateListing( dst, true );
+
   int pos = src.lastIndexOf("/");
   if( !ftpFolder(src.left(pos+1), false) )
       return false;
@@ -1216,6 +1862,8 @@ void Ftp::del( const QUrl& url, bool isfile )
   if ( !isfile )
     ftpFolder(remoteEncoding()->directory(url), false); // ignore errors
 
+  ftpInvalidateListing( url.path(), !isfile );
+
   QByteArray cmd = isfile ? "DELE " : "RMD ";
   cmd += remoteEncoding()->encode(url);
 
@@ -1225,7 +1873,16 @@ void Ftp::del( const QUrl& url, bool isfile )
     finished();
 }
 
-bool Ftp::ftpChmod( const QString & path, int permissions )
+/**
+ * The key of directory @p path in the listing cache
+ */
+static QString ftpListingKey( const QString& path )
+{
+  QString key = QDir::cleanPath( path );
+  return key.isEmpty() ? QStringLiteral("/") : key;
+}
+
+bool Ftp::ftpChmod( const QString & path, int permissions )
 {
   assert( m_bLoggedOn );
 
@@ -1239,7 +1896,16 @@ bool Ftp::ftpChmod( const QString & path, int permissions )
 
   ftpSendCmd(remoteEncoding()->encode(cmd));
   if(m_iRespType == 2)
-     return true;
+  {
+    // patch the cached listing of the parent rather than dropping it
+    QString key = ftpListingKey( path );
+    QString filename = key.mid( key.lastIndexOf('/') + 1 );
+    FtpListing* listing = m_listCache.object( ftpListingKey(key.left( key.lastIndexOf('/') + 1 )) );
+    for( int i = 0; listing && i < listing->entries.count(); ++i )
+      if( listing->entries[i].name == filename )
+        listing->entries[i].access = (listing->entries[i].access & ~0777) | (permissions & 0777);
+    return true;
+  }
 
   if(m_iRespCode == 500)
   {
@@ -1263,6 +1929,7 @@ void Ftp::chmod( const QUrl & url, int permissions )
 void Ftp::ftpCreateUDSEntry( const QString & filename, FtpEntry& ftpEnt, UDSEntry& entry, bool isDir )
 {
   assert(entry.count() == 0); // by contract :-)
+  entry.reserve( 9 );          // all the fields below
 
   entry.insert( KIO::UDSEntry::UDS_NAME, filename );
   entry.insert( KIO::UDSEntry::UDS_SIZE, ftpEnt.size );
@@ -1368,14 +2035,41 @@ void Ftp::stat( const QUrl &url)
   Q_ASSERT(!filename.isEmpty());
   QString search = filename;
 
+  QString sDetails = metaData("details");
+  int details = sDetails.isEmpty() ? 2 : sDetails.toInt();
+  qCDebug(KIO_FTPS) << "Ftp::stat details=" << details;
+
+  if( ftpStatCached( path, filename, details ) )
+    return;
+
+  // Try the one that worked last first, then the others from the cheapest
+  // on. The listing of the parent is never remembered, a probe may only
+  // have failed for this path.
+  int iLast = (m_statProbe > statProbeUnknown && m_statProbe < statProbeList) ? m_statProbe : 0;
+  for( int i = iLast ? 0 : int(statProbeMlst); i < statProbeList; ++i )
+  {
+    int iProbe = (i == 0) ? iLast : i;
+    if( i > 0 && i == iLast )
+      continue;
+    bool bAnswered = false;
+    if( iProbe == statProbeMlst )
+      bAnswered = (m_extControl & mlstSupported) && ftpStatMlst( path, filename, details );
+    else if( iProbe == statProbeSizeMdtm )
+      bAnswered = ftpStatSizeMdtm( path, filename, details );
+    else if( iProbe == statProbeStat )
+      bAnswered = ftpStatStat( path, filename, details );
+    if( bAnswered )
+    {
+      ftpStatProbeWorked( iProbe );
+      return;
+    }
+  }
+
   // Try cwd into it, if it works it's a dir (and then we'll list the parent directory to get more info)
   // if it doesn't work, it's a file (and then we'll use dir filename)
   bool isDir = ftpFolder(path, false);
 
   // if we're only interested in "file or directory", we should stop here
-  QString sDetails = metaData("details");
-  int details = sDetails.isEmpty() ? 2 : sDetails.toInt();
-  qCDebug(KIO_FTPS) << "Ftp::stat details=" << details;
   if ( details == 0 )
   {
      if ( !isDir && !ftpSize( path, 'I' ) ) // ok, not a dir -> is it a file ?
@@ -1507,6 +2201,390 @@ void Ftp::stat( const QUrl &url)
 }
 
 
+/**
+ * Seconds since the epoch for a UTC time, without the time zone lookups
+ * of mktime(). @p month is 1..12.
+ */
+static time_t ftpUtcTime( int year, int month, int day, int hour, int minute, int second )
+{
+  // days from 1970-01-01, counting years from March so that the leap day
+  // comes last (H. Hinnant's days_from_civil)
+  year -= month <= 2;
+  int era = (year >= 0 ? year : year - 399) / 400;
+  int yoe = year - era * 400;
+  int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  qint64 days = qint64(era) * 146097 + doe - 719468;
+  return time_t( days * 86400 + hour * 3600 + minute * 60 + second );
+}
+
+bool Ftp::ftpStatMlst( const QString& path, const QString& filename, int details )
+{
+  ftpRestoreMlstFacts();
+  QByteArray cmd = "MLST ";
+  cmd += remoteEncoding()->encode(path);
+  if( !ftpSendCmd( cmd ) || m_iRespType == 0 )
+    return false;
+  if( m_iRespCode == 500 || m_iRespCode == 502 )
+  { // not so well supported after all
+    qCDebug(KIO_FTPS) << "MLST failed, not using it any more";
+    m_extControl &= ~mlstSupported;
+    return false;
+  }
+  if( m_iRespType == 5 && m_iRespCode != 550 )
+    return false;                          // e.g. 501 for this path, try STAT
+  if( m_iRespType != 2 )
+  {
+    ftpStatAnswerNotFound( path, filename );
+    return true;
+  }
+
+  // 250-Listing /path
+  //  type=file;size=123;modify=20240101120000; /path/file
+  // 250 End
+  FtpEntry ftpEnt;
+  bool bParsed = false;
+  for( int i = 1; i < m_responseLines.size() && !bParsed; ++i )
+    if( m_responseLines[i].startsWith(' ') )
+      bParsed = ftpParseMlsx( m_responseLines[i].mid(1), ftpEnt );
+  if( !bParsed )
+    return false;
+
+  bool isDir = S_ISDIR( ftpEnt.type );
+  if( details == 0 )
+  {
+    ftpShortStatAnswer( filename, isDir );
+    return true;
+  }
+  UDSEntry entry;
+  ftpCreateUDSEntry( filename, ftpEnt, entry, isDir );
+  statEntry( entry );
+  finished();
+  return true;
+}
+
+void Ftp::ftpStatProbeWorked( int iProbe )
+{
+  if( m_statProbe == iProbe )
+    return;
+  qCDebug(KIO_FTPS) << "stat probe for " << m_host << ": " << iProbe;
+  m_statProbe = iProbe;
+  ftpSaveHostCache();
+}
+
+bool Ftp::ftpStatSizeMdtm( const QString& path, const QString& filename, int details )
+{
+  QByteArray sizeCmd = "SIZE ";
+  sizeCmd += remoteEncoding()->encode(path);
+  QByteArray mdtmCmd = "MDTM ";
+  mdtmCmd += remoteEncoding()->encode(path);
+  bool bTypeQueued = ftpDataMode('I', true);
+  ftpQueueCmd( sizeCmd );
+  if( details > 0 )
+    ftpQueueCmd( mdtmCmd );
+  ftpFlushCmdQueue();
+
+  if( bTypeQueued && ftpUseResponse("TYPE") && m_iRespType != 2 )
+    return false;
+  if( ftpSizeResponse( sizeCmd ) )
+  { // only files have a size
+    if( details == 0 )
+    {
+      ftpShortStatAnswer( filename, false );
+      return true;
+    }
+
+    // SIZE and MDTM tell nothing about permissions or owner, so those
+    // fields are left out rather than made up
+    UDSEntry entry;
+    entry.reserve( 4 );
+    entry.insert( KIO::UDSEntry::UDS_NAME, filename );
+    entry.insert( KIO::UDSEntry::UDS_SIZE, (m_size == UnknownSize) ? 0 : m_size );
+    entry.insert( KIO::UDSEntry::UDS_FILE_TYPE, S_IFREG );
+
+    // "213 YYYYMMDDHHMMSS[.sss]", always UTC
+    int t[6];
+    if( ftpUseResponse( mdtmCmd ) && m_iRespType == 2 &&
+        sscanf( ftpResponse(4), "%4d%2d%2d%2d%2d%2d", &t[0], &t[1], &t[2], &t[3], &t[4], &t[5] ) == 6 )
+      entry.insert( KIO::UDSEntry::UDS_MODIFICATION_TIME,
+                    ftpUtcTime( t[0], t[1], t[2], t[3], t[4], t[5] ) );
+
+    statEntry( entry );
+    finished();
+    return true;
+  }
+
+  // 500/502: no SIZE at all. Servers refuse SIZE on directories and on
+  // what does not exist, CWD tells which one it is.
+  if( m_iRespCode != 550 && m_iRespCode != 450 )
+    return false;
+  QString currentPath( m_currentPath );
+  if( ftpFolder( path, false ) )
+  {
+    // Change the directory back to what it was...
+    if( !currentPath.isEmpty() )
+      (void) ftpFolder( currentPath, false );
+    ftpShortStatAnswer( filename, true );
+  }
+  else
+    ftpStatAnswerNotFound( path, filename );
+  return true;
+}
+
+bool Ftp::ftpStatStat( const QString& path, const QString& filename, int details )
+{
+  QByteArray cmd = "STAT ";
+  cmd += remoteEncoding()->encode(path);
+  if( !ftpSendCmd( cmd ) || m_iRespType == 0 )
+    return false;
+  if( m_iRespType == 5 && m_iRespCode != 550 )
+    return false;                          // no STAT <path> here
+
+  // 213-Status of /path/file:
+  // -rw-r--r--   1 owner    group        1234 Jan  1 12:00 /path/file
+  // 213 End of status
+  // For a directory the server lists its content instead, which may
+  // hold a child of the same name: only a reply with a single entry and
+  // no "." describes the path itself.
+  bool bStatOk = (m_iRespType == 2);
+  m_iListYear = 0;                         // see ftpStartListing()
+  int iEntries = 0;
+  bool bDot = false;
+  FtpEntry ftpEnt;
+  FtpEntry parsed;
+  for( int i = 1; i < m_responseLines.size() && bStatOk; ++i )
+  {
+    QByteArray line = m_responseLines[i];
+    if( !ftpParseDirLine( line.data(), parsed, true ) )
+      continue;
+    if( parsed.name == "." )
+      bDot = true;
+    else if( ++iEntries == 1 )
+      ftpEnt = parsed;
+  }
+  bool bListed = (iEntries > 0 || bDot);
+  bool bFound = (iEntries == 1 && !bDot && ftpEnt.name == filename);
+
+  if( bFound && !S_ISDIR( ftpEnt.type ) )
+  {
+    if( details == 0 )
+      ftpShortStatAnswer( filename, false );
+    else
+    {
+      UDSEntry entry;
+      ftpCreateUDSEntry( filename, ftpEnt, entry, false );
+      statEntry( entry );
+      finished();
+    }
+    return true;
+  }
+
+  if( ftpFolder( path, false ) )
+  {
+    ftpShortStatAnswer( filename, true );
+    return true;
+  }
+  if( !bListed && bStatOk )
+    return false;                          // the answer was no listing at all
+  ftpStatAnswerNotFound( path, filename );
+  return true;
+}
+
+bool Ftp::ftpParseMlsx( const QByteArray& line, FtpEntry& de )
+{
+  // the facts end at the first space, the name follows it
+  int iSpace = line.indexOf(' ');
+  if( iSpace < 0 )
+    return false;
+  QByteArray name = line.mid( iSpace + 1 );
+  while( name.endsWith('\n') || name.endsWith('\r') )
+    name.chop(1);
+  if( name.isEmpty() )
+    return false;
+
+  de.type = S_IFREG;
+  de.access = 0;
+  de.size = 0;
+  de.date = 0;
+  de.owner.clear();
+  de.group.clear();
+  de.link.clear();
+  de.unique.clear();
+  bool bMode = false;
+  QByteArray perm;
+
+  Q_FOREACH( const QByteArray& fact, line.left( iSpace ).split(';') )
+  {
+    int iEq = fact.indexOf('=');
+    if( iEq <= 0 )
+      continue;
+    QByteArray key = fact.left( iEq ).toLower();
+    QByteArray value = fact.mid( iEq + 1 );
+
+    if( key == "type" )
+    {
+      QByteArray type = value.toLower();
+      if( type == "file" )
+        de.type = S_IFREG;
+      else if( type == "dir" )
+        de.type = S_IFDIR;
+      else if( type == "cdir" )
+      {
+        de.type = S_IFDIR;
+        name = ".";
+      }
+      else if( type == "pdir" )
+      {
+        de.type = S_IFDIR;
+        name = "..";
+      }
+      else if( type.startsWith("os.unix=slink") || type.startsWith("os.unix=symlink") )
+      { // OS.unix=slink:/target, like with LIST the type is left to the mimetype
+        int iColon = value.indexOf(':');
+        de.link = iColon > 0 ? ftpInternListing( value.constData() + iColon + 1, value.size() - iColon - 1 ) : QString();
+        if( de.link.isEmpty() )
+          de.link = QString::fromLatin1(".");
+      }
+    }
+    else if( key == "size" || key == "sizd" )
+      de.size = value.toULongLong();
+    else if( key == "modify" )
+    { // YYYYMMDDHHMMSS[.sss], always UTC
+      int t[6];
+      if( sscanf( value.constData(), "%4d%2d%2d%2d%2d%2d",
+                  &t[0], &t[1], &t[2], &t[3], &t[4], &t[5] ) == 6 )
+        de.date = ftpUtcTime( t[0], t[1], t[2], t[3], t[4], t[5] );
+    }
+    else if( key == "perm" )
+      perm = value.toLower();
+    else if( key == "unique" )
+      de.unique = value;
+    else if( key == "unix.mode" )
+    {
+      de.access = strtol( value.constData(), 0, 8 ) & 07777;
+      bMode = true;
+    }
+    else if( key == "unix.owner" || key == "unix.ownername" || key == "unix.uid" )
+    {
+      if( de.owner.isEmpty() || key == "unix.ownername" )
+        de.owner = ftpInternListing( value.constData(), value.size() );
+    }
+    else if( key == "unix.group" || key == "unix.groupname" || key == "unix.gid" )
+    {
+      if( de.group.isEmpty() || key == "unix.groupname" )
+        de.group = ftpInternListing( value.constData(), value.size() );
+    }
+  }
+
+  // Without UNIX.mode, perm tells what we may do, i.e. the owner bits
+  if( !bMode )
+  {
+    if( perm.contains('r') || perm.contains('l') )
+      de.access |= S_IRUSR;
+    if( perm.contains('w') || perm.contains('a') || perm.contains('c') ||
+        perm.contains('m') || perm.contains('p') )
+      de.access |= S_IWUSR;
+    if( perm.contains('e') )
+      de.access |= S_IXUSR;
+  }
+
+  if( name.startsWith('/') )             // MLST answers with the full path
+    name = name.mid( name.lastIndexOf('/') + 1 );
+  else if( name.indexOf('/') != -1 )
+    return false;                        // Don't trick us!
+  if( name.isEmpty() )
+    return false;
+  de.name = remoteEncoding()->decode( name );
+  return true;
+}
+
+FtpListing* Ftp::ftpCachedListing( const QString& path )
+{
+  int iTtl = config()->readEntry("ListingCacheTTL", 15);
+  if( iTtl <= 0 )
+    return 0;
+
+  QString key = ftpListingKey( path );
+  FtpListing* listing = m_listCache.object( key );
+  if( listing && QDateTime::currentMSecsSinceEpoch() - listing->time > qint64(iTtl) * 1000 )
+  {
+    m_listCache.remove( key );
+    listing = 0;
+  }
+  if( listing )
+    ++m_iListCacheHits;
+  else
+    ++m_iListCacheMisses;
+  return listing;
+}
+
+void Ftp::ftpCacheListing( const QString& path, const QList<FtpEntry>& entries )
+{
+  if( config()->readEntry("ListingCacheTTL", 15) <= 0 )
+    return;
+  m_listCache.setMaxCost( qMax(1, config()->readEntry("ListingCacheSize", 4096)) );
+
+  // the cost is a rough estimate of the memory in KiB
+  qint64 iBytes = sizeof(FtpListing);
+  for( int i = 0; i < entries.count(); ++i )
+  {
+    const FtpEntry& e = entries[i];
+    iBytes += sizeof(FtpEntry) + e.unique.size() +
+              2 * (e.name.size() + e.owner.size() + e.group.size() + e.link.size());
+  }
+
+  FtpListing* listing = new FtpListing;
+  listing->entries = entries;
+  listing->time = QDateTime::currentMSecsSinceEpoch();
+  m_listCache.insert( ftpListingKey(path), listing, int(qMin<qint64>(iBytes / 1024 + 1, m_listCache.maxCost() + 1)) );
+}
+
+void Ftp::ftpInvalidateListing( const QString& path, bool bSubtree )
+{
+  QString key = ftpListingKey( path );
+  if( key != "/" )
+    m_listCache.remove( ftpListingKey(key.left( key.lastIndexOf('/') + 1 )) );
+  if( !bSubtree )
+    return;
+
+  QString prefix = (key == "/") ? key : key + '/';
+  m_listCache.remove( key );
+  Q_FOREACH( const QString& cached, m_listCache.keys() )
+    if( cached.startsWith(prefix) )
+      m_listCache.remove( cached );
+}
+
+bool Ftp::ftpStatCached( const QString& path, const QString& filename, int details )
+{
+  QString key = ftpListingKey( path );
+  FtpListing* listing = ftpCachedListing( key.left( key.lastIndexOf('/') + 1 ) );
+  if( !listing )
+    return false;
+
+  for( int i = 0; i < listing->entries.count(); ++i )
+  {
+    FtpEntry& ftpEnt = listing->entries[i];
+    if( ftpEnt.name != filename )
+      continue;
+    qCDebug(KIO_FTPS) << "stat " << path << " from the cached listing";
+    if( details == 0 )
+    {
+      // only a CWD can tell whether a link points to a dir
+      if( !ftpEnt.link.isEmpty() )
+        return false;
+      ftpShortStatAnswer( filename, S_ISDIR(ftpEnt.type) );
+      return true;
+    }
+    UDSEntry entry;
+    ftpCreateUDSEntry( filename, ftpEnt, entry, false );
+    statEntry( entry );
+    finished();
+    return true;
+  }
+  // not in the listing, it may have appeared since, ask the server
+  return false;
+}
+
 void Ftp::listDir( const QUrl &url )
 {
   qCDebug(KIO_FTPS) << "Ftp::listDir " << url.toDisplayString();
@@ -1538,7 +2616,32 @@ void Ftp::listDir( const QUrl &url )
 
   qCDebug(KIO_FTPS) << "hunting for path '" << path << "'";
 
-  if (!ftpOpenDir( path ) )
+  if( FtpListing* listing = ftpCachedListing( path ) )
+  {
+    qCDebug(KIO_FTPS) << "listing " << path << " from the cache";
+    ftpStartListEntries();
+    for( int i = 0; i < listing->entries.count(); ++i )
+      ftpListEntry( listing->entries[i] );
+    ftpFlushListEntries();
+    finished();
+    return;
+  }
+
+  QList<FtpEntry> entries;
+  if( ftpListOverControl( path, entries ) )
+  {
+    ftpStartListEntries();
+    for( int i = 0; i < entries.count(); ++i )
+      ftpListEntry( entries[i] );
+    ftpFlushListEntries();
+    ftpCacheListing( path, entries );
+    finished();
+    return;
+  }
+
+  QString sDetails = metaData("details");
+  int details = sDetails.isEmpty() ? 2 : sDetails.toInt();
+  if (!ftpOpenDir( path, details ) )
   {
     if ( ftpSize( path, 'I' ) ) // is it a file ?
     {
@@ -1551,8 +2654,13 @@ void Ftp::listDir( const QUrl &url )
     return;
   }
 
-  UDSEntry entry;
+  QElapsedTimer timer;
+  timer.start();
+  qint64 cpuStart = cpuTimeMs();
+  // names and types only, see ftpOpenDir()
+  bool bNamesOnly = m_bNlst || (m_bMlsd && m_bMlstFactsReduced);
   FtpEntry  ftpEnt;
+  ftpStartListEntries();
   while( ftpReadDir(ftpEnt) )
   {
     //qCDebug(KIO_FTPS) << ftpEnt.name;
@@ -1563,23 +2671,124 @@ void Ftp::listDir( const QUrl &url )
       //   qCDebug(KIO_FTPS) << "is a dir";
       //if ( !ftpEnt.link.isEmpty() )
       //   qCDebug(KIO_FTPS) << "is a link to " << ftpEnt.link;
-      entry.clear();
-      ftpCreateUDSEntry( ftpEnt.name, ftpEnt, entry, false );
-      listEntry( entry );
+      ftpListEntry( ftpEnt, bNamesOnly );
+      if ( !bNamesOnly )
+        entries.append( ftpEnt );
     }
   }
+  ftpFlushListEntries();
 
-  ftpCloseCommand();        // closes the data connection only
+  qint64 ms = qMax<qint64>( timer.elapsed(), 1 );
+  qCDebug(KIO_FTPS) << "listed" << entries.count() << "entries in" << ms << "ms,"
+                    << entries.count() * 1000 / ms << "entries/s, CPU" << cpuTimeMs() - cpuStart << "ms";
+
+  if( ftpCloseCommand() && !bNamesOnly )  // closes the data connection only
+    ftpCacheListing( path, entries );   // only complete listings
   finished();
 }
 
+void Ftp::ftpStartListEntries()
+{
+  m_listBatch.clear();
+  m_iListBatchLimit = 64;
+  m_listBatchTimer.start();
+}
+
+void Ftp::ftpListEntry( FtpEntry& ftpEnt, bool bNamesOnly )
+{
+  m_listBatch.append( UDSEntry() );
+  UDSEntry& entry = m_listBatch.last();
+  if( bNamesOnly )
+  {
+    entry.reserve( 4 );
+    entry.insert( KIO::UDSEntry::UDS_NAME, ftpEnt.name );
+    entry.insert( KIO::UDSEntry::UDS_FILE_TYPE, S_ISDIR(ftpEnt.type) ? S_IFDIR : S_IFREG );
+    entry.insert( KIO::UDSEntry::UDS_ACCESS, S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH );
+    if( !ftpEnt.link.isEmpty() )
+      entry.insert( KIO::UDSEntry::UDS_LINK_DEST, ftpEnt.link );
+  }
+  else
+    ftpCreateUDSEntry( ftpEnt.name, ftpEnt, entry, false );
+  if( m_listBatch.count() >= m_iListBatchLimit || m_listBatchTimer.elapsed() >= 200 )
+    ftpFlushListEntries();
+}
+
+void Ftp::ftpFlushListEntries()
+{
+  if( !m_listBatch.isEmpty() )
+    listEntries( m_listBatch );
+  m_listBatch.clear();
+  // small batches first so that the view fills in at once, then larger ones
+  m_iListBatchLimit = qMin( m_iListBatchLimit * 2, 2048 );
+  m_listBatchTimer.restart();
+}
+
 void Ftp::slave_status()
 {
   qCDebug(KIO_FTPS) << "Got slave_status host = " << (!m_host.toLatin1().isEmpty() ? m_host.toLatin1() : "[None]") << " [" << (m_bLoggedOn ? "Connected" : "Not connected") << "]";
+  qCDebug(KIO_FTPS) << "  listing cache: hits=" << m_iListCacheHits << " misses=" << m_iListCacheMisses
+                    << " listings=" << m_listCache.count() << " KiB=" << m_listCache.totalCost();
   slaveStatus( m_host, m_bLoggedOn );
 }
 
-bool Ftp::ftpOpenDir( const QString & path )
+bool Ftp::ftpListOverControl( const QString& path, QList<FtpEntry>& entries )
+{
+  if( (m_extControl & statListUnknown) || !config()->readEntry("ListOverControl", false) )
+    return false;
+  QString key = ftpListingKey( path );
+  if( m_largeDirs.contains( key ) )
+    return false;
+
+  // CWD first like ftpOpenDir(), it follows links and fails for files
+  if( !ftpFolder( key, false ) )
+    return false;
+
+  // 213-Status of .:
+  // drwxr-xr-x   2 owner    group        4096 Jan  1 12:00 .
+  // -rw-r--r--   1 owner    group        1234 Jan  1 12:00 file
+  // 213 End of status
+  // No retries, a reconnect would have the login replies parsed as listing
+  m_iListYear = 0;
+  m_pStreamEntries = &entries;
+  bool bOk = ftpSendCmd( "STAT -la .", 0 ) && m_iRespType == 2;
+  m_pStreamEntries = NULL;
+  if( !bOk )
+  {
+    if( m_iRespType == 5 )
+    {
+      qCDebug(KIO_FTPS) << "STAT can't list here - disabling";
+      m_extControl |= statListUnknown;
+    }
+    entries.clear();
+    return false;
+  }
+
+  // The control connection is no place for big listings, nothing else
+  // can be sent while they come in
+  int iMaxEntries = config()->readEntry("ListOverControlMaxEntries", 1000);
+  if( entries.count() > iMaxEntries )
+  {
+    qCDebug(KIO_FTPS) << key << "has" << entries.count() << "entries, listing it with LIST from now on";
+    m_largeDirs.insert( key );
+  }
+  return true;
+}
+
+void Ftp::ftpStreamListingLine( QByteArray& line, int iCode )
+{
+  while( line.endsWith('\n') || line.endsWith('\r') )
+    line.chop(1);
+  char* p = line.data();
+  // some servers put "nnn-" in front of every line
+  if( line.size() >= 4 && atoi(p) == iCode && p[3] == '-' )
+    p += 4;
+
+  FtpEntry ftpEnt;
+  if( ftpParseDirLine( p, ftpEnt ) && !ftpEnt.name.isEmpty() )
+    m_pStreamEntries->append( ftpEnt );
+}
+
+bool Ftp::ftpOpenDir( const QString & path, int details )
 {
   //QString path( _url.path(QUrl::RemoveTrailingSlash) );
 
@@ -1591,15 +2800,44 @@ bool Ftp::ftpOpenDir( const QString & path )
   if( !ftpFolder(tmp, false) )
       return false;
 
+  // listings are text, they shrink to a fraction in MODE Z
+  bool bCompress = ftpWantCompression( QString() );
+
+  // MLSD gives exact machine readable facts, see ftpParseMlsx(). If only
+  // names and types are wanted we ask for nothing but the type.
+  if( (m_extControl & mlstSupported) )
+  {
+    if( details == 0 && !m_bMlstFactsReduced )
+      ftpQueueCmd( "OPTS MLST type;" );
+    else if( details != 0 )
+      ftpRestoreMlstFacts();
+    if( ftpOpenCommand( "mlsd", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY, 0, bCompress ) )
+    {
+      qCDebug(KIO_FTPS) << "Starting of mlsd was ok";
+      m_bMlsd = true;
+      return true;
+    }
+  }
+
+  // NLST has no types, so it needs the "NlstNameOnlyListing" config entry
+  // from users who can live with directories shown as files
+  if( details == 0 && config()->readEntry("NlstNameOnlyListing", false) &&
+      ftpOpenCommand( "nlst", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY, 0, bCompress ) )
+  {
+    qCDebug(KIO_FTPS) << "Starting of nlst was ok";
+    m_bNlst = true;
+    return true;
+  }
+
   // Don't use the path in the list command:
   // We changed into this directory anyway - so it's enough just to send "list".
   // We use '-a' because the application MAY be interested in dot files.
   // The only way to really know would be to have a metadata flag for this...
   // Since some windows ftp server seems not to support the -a argument, we use a fallback here.
   // In fact we have to use -la otherwise -a removes the default -l (e.g. ftp.trolltech.com)
-  if( !ftpOpenCommand( "list -la", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY ) )
+  if( !ftpOpenCommand( "list -la", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY, 0, bCompress ) )
   {
-    if ( !ftpOpenCommand( "list", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY ) )
+    if ( !ftpOpenCommand( "list", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY, 0, bCompress ) )
     {
       qCWarning(KIO_FTPS) << "Can't open for listing";
       return false;
@@ -1614,207 +2852,410 @@ bool Ftp::ftpReadDir(FtpEntry& de)
 
   assert(m_data != NULL);
 
-  // get a line from the data connecetion ...
+  // The listing is read in large chunks into m_dirBuffer and parsed where
+  // it lies, lines are cut by putting a NUL over their '\n'.
   while( true )
   {
-    while (!m_data->canReadLine() && m_data->waitForReadyRead()) {}
-    QByteArray data = m_data->readLine();
-    if (data.size() == 0)
-      break;
-
-    const char* buffer = data.data();
-    qCDebug(KIO_FTPS) << "dir > " << buffer;
-
-    //Normally the listing looks like
-    // -rw-r--r--   1 dfaure   dfaure        102 Nov  9 12:30 log
-    // but on Netware servers like ftp://ci-1.ci.pwr.wroc.pl/ it looks like (#76442)
-    // d [RWCEAFMS] Admin                     512 Oct 13  2004 PSI
-
-    // we should always get the following 5 fields ...
-    const char *p_access, *p_junk, *p_owner, *p_group, *p_size;
-    if( (p_access = strtok((char*)buffer," ")) == 0) continue;
-    if( (p_junk  = strtok(NULL," ")) == 0) continue;
-    if( (p_owner = strtok(NULL," ")) == 0) continue;
-    if( (p_group = strtok(NULL," ")) == 0) continue;
-    if( (p_size  = strtok(NULL," ")) == 0) continue;
-
-    //qCDebug(KIO_FTPS) << "p_access=" << p_access << " p_junk=" << p_junk << " p_owner=" << p_owner << " p_group=" << p_group << " p_size=" << p_size;
-
-    de.access = 0;
-    if ( strlen( p_access ) == 1 && p_junk[0] == '[' ) { // Netware
-      de.access = S_IRWXU | S_IRWXG | S_IRWXO; // unknown -> give all permissions
-    }
-
-    const char *p_date_1, *p_date_2, *p_date_3, *p_name;
-
-    // A special hack for "/dev". A listing may look like this:
-    // crw-rw-rw-   1 root     root       1,   5 Jun 29  1997 zero
-    // So we just ignore the number in front of the ",". Ok, its a hack :-)
-    if ( strchr( p_size, ',' ) != 0L )
+    char* line = m_dirBuffer.data() + m_iDirPos;
+    char* nl = (char*)memchr( line, '\n', m_dirBuffer.size() - m_iDirPos );
+    if( nl == 0 )
     {
-      //qCDebug(KIO_FTPS) << "Size contains a ',' -> reading size again (/dev hack)";
-      if ((p_size = strtok(NULL," ")) == 0)
-        continue;
+      // keep the incomplete line and append the next chunk to it
+      m_dirBuffer.remove( 0, m_iDirPos );
+      m_iDirPos = 0;
+      int iOld = m_dirBuffer.size();
+      qint64 n;
+      if( m_zData )
+      {
+        m_dirBuffer.resize( iOld + 256 * 1024 );
+        n = ftpInflateData( m_dirBuffer.data() + iOld, 256 * 1024 );
+      }
+      else
+      {
+        if( m_data->bytesAvailable() <= 0 && !m_data->waitForReadyRead() )
+        {
+          if( m_dirBuffer.isEmpty() )
+            return false;
+          m_dirBuffer.append( '\n' );       // the last line had no end
+          continue;
+        }
+        int iChunk = int(qBound<qint64>( 1, m_data->bytesAvailable(), 256 * 1024 ));
+        m_dirBuffer.resize( iOld + iChunk );
+        n = m_data->read( m_dirBuffer.data() + iOld, iChunk );
+      }
+      m_dirBuffer.resize( iOld + int(qMax<qint64>( n, 0 )) );
+      if( n <= 0 && m_dirBuffer.isEmpty() )
+        return false;
+      if( n <= 0 )
+        m_dirBuffer.append( '\n' );
+      continue;
     }
 
-    // Check whether the size we just read was really the size
-    // or a month (this happens when the server lists no group)
-    // Used to be the case on sunsite.uio.no, but not anymore
-    // This is needed for the Netware case, too.
-    if ( !isdigit( *p_size ) )
+    m_iDirPos = nl + 1 - m_dirBuffer.data();
+    *nl = '\0';
+    if( nl > line && nl[-1] == '\r' )
+      *--nl = '\0';
+
+    if ( m_bMlsd )
     {
-      p_date_1 = p_size;
-      p_size = p_group;
-      p_group = 0;
-      //qCDebug(KIO_FTPS) << "Size didn't have a digit -> size=" << p_size << " date_1=" << p_date_1;
+      if ( ftpParseMlsx( QByteArray::fromRawData( line, nl - line ), de ) )
+        return true;
+      continue;
     }
-    else
+    if ( m_bNlst )
     {
-      p_date_1 = strtok(NULL," ");
-      //qCDebug(KIO_FTPS) << "Size has a digit -> ok. p_date_1=" << p_date_1;
+      if ( ftpParseNlst( line, de ) )
+        return true;
+      continue;
     }
+    if ( ftpParseDirLine( line, de ) )
+      return true;
+  } // line invalid, loop to get another line
+  return false;
+}
 
-    if ( p_date_1 != 0 &&
-         (p_date_2 = strtok(NULL," ")) != 0 &&
-         (p_date_3 = strtok(NULL," ")) != 0 &&
-         (p_name = strtok(NULL,"\r\n")) != 0 )
-    {
-      {
-        QByteArray tmp( p_name );
-        if ( p_access[0] == 'l' )
-        {
-          int i = tmp.lastIndexOf( " -> " );
-          if ( i != -1 ) {
-            de.link = remoteEncoding()->decode(p_name + i + 4);
-            tmp.truncate( i );
-          }
-          else
-            de.link.clear();
-        }
-        else
-          de.link.clear();
-
-        if ( tmp[0] == '/' ) // listing on ftp://ftp.gnupg.org/ starts with '/'
-          tmp.remove( 0, 1 );
+void Ftp::ftpRestoreMlstFacts()
+{
+  if( !m_bMlstFactsReduced )
+    return;
+  // Without FEAT (the host cache knew it) ask for everything we can use
+  QByteArray cmd = "OPTS MLST ";
+  cmd += m_mlstFacts.isEmpty() ?
+    QByteArray( "type;size;modify;perm;unique;unix.mode;unix.owner;unix.group;" ) : m_mlstFacts;
+  ftpQueueCmd( cmd );
+}
 
-        if (tmp.indexOf('/') != -1)
-          continue; // Don't trick us!
-        // Some sites put more than one space between the date and the name
-        // e.g. ftp://ftp.uni-marburg.de/mirror/
-        de.name     = remoteEncoding()->decode(tmp.trimmed());
-      }
+bool Ftp::ftpParseNlst( char* line, FtpEntry& de )
+{
+  // "name", "dir/name" or "name/" for a directory on some servers
+  int len = strlen( line );
+  de.type = S_IFREG;
+  if( len > 1 && line[len - 1] == '/' )
+  {
+    de.type = S_IFDIR;
+    line[--len] = '\0';
+  }
+  char* slash = strrchr( line, '/' );
+  char* name = slash ? slash + 1 : line;
+  if( *name == '\0' )
+    return false;
+  de.name = ftpDecodeListing( name, line + len - name );
+  de.access = 0;
+  de.size = 0;
+  de.date = 0;
+  de.owner.clear();
+  de.group.clear();
+  de.link.clear();
+  de.unique.clear();
+  return true;
+}
 
-      de.type = S_IFREG;
-      switch ( p_access[0] ) {
-      case 'd':
-        de.type = S_IFDIR;
-        break;
-      case 's':
-        de.type = S_IFSOCK;
-        break;
-      case 'b':
-        de.type = S_IFBLK;
-        break;
-      case 'c':
-        de.type = S_IFCHR;
-        break;
-      case 'l':
-        de.type = S_IFREG;
-        // we don't set S_IFLNK here.  de.link says it.
-        break;
-      default:
+void Ftp::ftpStartListing()
+{
+  // Dates without a year are from the last 12 months, see ftpParseDirLine()
+  QDateTime now = QDateTime::currentDateTime();
+  QDate today = now.toUTC().date();
+  m_iListYear = today.year();
+  m_iListMonth = today.month();
+  // The server's local time is taken for ours, like mktime() would, see
+  // ftpParseDirLine()
+  m_iListUtcOffset = now.offsetFromUtc();
+  m_iListOffsetHour = -1;
+
+  // Codecs that keep ASCII as it is let plain names skip the decoding
+  m_bListAscii = (remoteEncoding()->decode( QByteArray( "Az09 ._-~" ) ) ==
+                  QLatin1String( "Az09 ._-~" ));
+}
+
+QString Ftp::ftpDecodeListing( const char* p, int len )
+{
+  if( m_iListYear == 0 )
+    ftpStartListing();
+  if( m_bListAscii )
+  {
+    int i = 0;
+    while( i < len && (unsigned char)p[i] < 0x80 )
+      ++i;
+    if( i == len )
+      return QString::fromLatin1( p, len );
+  }
+  return remoteEncoding()->decode( QByteArray::fromRawData( p, len ) );
+}
+
+QString Ftp::ftpInternListing( const char* p, int len )
+{
+  QHash<QByteArray, QString>::const_iterator it =
+    m_listStrings.constFind( QByteArray::fromRawData( p, len ) );
+  if( it != m_listStrings.constEnd() )
+    return it.value();
+
+  // a listing full of distinct link targets must not grow it forever
+  if( m_listStrings.size() >= 4096 )
+    m_listStrings.clear();
+  QString str = ftpDecodeListing( p, len );
+  m_listStrings.insert( QByteArray( p, len ), str );
+  return str;
+}
+
+/**
+ * Returns the next blank separated field of a listing line and moves @p p
+ * behind it, or 0 at the end of the line. The field gets NUL terminated.
+ */
+static inline char* ftpNextField( char*& p )
+{
+  while( *p == ' ' )
+    ++p;
+  if( *p == '\0' )
+    return 0;
+  char* field = p;
+  while( *p != ' ' && *p != '\0' )
+    ++p;
+  if( *p == ' ' )
+    *p++ = '\0';
+  return field;
+}
+
+/**
+ * The month 1..12 of an English three letter abbreviation, 0 if it is none
+ */
+static int ftpParseMonth( const char* p )
+{
+  // NOTE : no, we don't want to use QLocale here
+  // It seems all FTP servers use the English way
+  static const char s_months[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  if( p[0] == '\0' || p[1] == '\0' || p[2] == '\0' || p[3] != '\0' )
+    return 0;
+  int month;
+  switch( p[0] ) {
+  case 'J': month = (p[1] == 'a') ? 1 : (p[2] == 'n') ? 6 : 7; break;
+  case 'F': month = 2; break;
+  case 'M': month = (p[2] == 'r') ? 3 : 5; break;
+  case 'A': month = (p[1] == 'p') ? 4 : 8; break;
+  case 'S': month = 9; break;
+  case 'O': month = 10; break;
+  case 'N': month = 11; break;
+  case 'D': month = 12; break;
+  default: return 0;
+  }
+  const char* name = s_months[month - 1];
+  return (p[1] == name[1] && p[2] == name[2]) ? month : 0;
+}
+
+/**
+ * The value of the decimal digits at @p p, stops at the first non-digit
+ */
+static inline int ftpParseNumber( const char* p )
+{
+  int n = 0;
+  while( *p >= '0' && *p <= '9' )
+    n = n * 10 + (*p++ - '0');
+  return n;
+}
+
+bool Ftp::ftpParseDirLine(char* buffer, FtpEntry& de, bool bFullPath)
+{
+  //Normally the listing looks like
+  // -rw-r--r--   1 dfaure   dfaure        102 Nov  9 12:30 log
+  // but on Netware servers like ftp://ci-1.ci.pwr.wroc.pl/ it looks like (#76442)
+  // d [RWCEAFMS] Admin                     512 Oct 13  2004 PSI
+
+  if( m_iListYear == 0 )
+    ftpStartListing();
+
+  // we should always get the following 5 fields ...
+  char* p = buffer;
+  const char *p_access, *p_junk, *p_owner, *p_group, *p_size;
+  if( (p_access = ftpNextField(p)) == 0) return false;
+  if( (p_junk  = ftpNextField(p)) == 0) return false;
+  if( (p_owner = ftpNextField(p)) == 0) return false;
+  if( (p_group = ftpNextField(p)) == 0) return false;
+  if( (p_size  = ftpNextField(p)) == 0) return false;
+
+  //qCDebug(KIO_FTPS) << "p_access=" << p_access << " p_junk=" << p_junk << " p_owner=" << p_owner << " p_group=" << p_group << " p_size=" << p_size;
+
+  de.access = 0;
+  if ( p_access[1] == '\0' && p_junk[0] == '[' ) { // Netware
+    de.access = S_IRWXU | S_IRWXG | S_IRWXO; // unknown -> give all permissions
+  }
+
+  const char *p_date_1, *p_date_2, *p_date_3;
+
+  // A special hack for "/dev". A listing may look like this:
+  // crw-rw-rw-   1 root     root       1,   5 Jun 29  1997 zero
+  // So we just ignore the number in front of the ",". Ok, its a hack :-)
+  if ( strchr( p_size, ',' ) != 0L )
+  {
+    //qCDebug(KIO_FTPS) << "Size contains a ',' -> reading size again (/dev hack)";
+    if ((p_size = ftpNextField(p)) == 0)
+      return false;
+  }
+
+  // Check whether the size we just read was really the size
+  // or a month (this happens when the server lists no group)
+  // Used to be the case on sunsite.uio.no, but not anymore
+  // This is needed for the Netware case, too.
+  if ( !isdigit( *p_size ) )
+  {
+    p_date_1 = p_size;
+    p_size = p_group;
+    p_group = 0;
+    //qCDebug(KIO_FTPS) << "Size didn't have a digit -> size=" << p_size << " date_1=" << p_date_1;
+  }
+  else
+  {
+    p_date_1 = ftpNextField(p);
+    //qCDebug(KIO_FTPS) << "Size has a digit -> ok. p_date_1=" << p_date_1;
+  }
+
+  if ( p_date_1 == 0 ||
+       (p_date_2 = ftpNextField(p)) == 0 ||
+       (p_date_3 = ftpNextField(p)) == 0 )
+    return false;
+
+  // The name is the rest of the line. Some sites put more than one space
+  // between the date and the name, e.g. ftp://ftp.uni-marburg.de/mirror/
+  while ( isspace( (unsigned char)*p ) )
+    ++p;
+  char* nameEnd = p + strlen( p );
+  while ( nameEnd > p && isspace( (unsigned char)nameEnd[-1] ) )
+    --nameEnd;
+  if ( nameEnd == p )
+    return false;
+
+  de.link.clear();
+  if ( p_access[0] == 'l' )
+  {
+    // the last " -> " separates the target
+    for ( char* arrow = nameEnd - 4; arrow >= p; --arrow )
+      if ( arrow[0] == ' ' && arrow[1] == '-' && arrow[2] == '>' && arrow[3] == ' ' )
+      {
+        de.link = ftpInternListing( arrow + 4, nameEnd - arrow - 4 );
+        nameEnd = arrow;
         break;
       }
+  }
 
-      if ( p_access[1] == 'r' )
-        de.access |= S_IRUSR;
-      if ( p_access[2] == 'w' )
-        de.access |= S_IWUSR;
-      if ( p_access[3] == 'x' || p_access[3] == 's' )
-        de.access |= S_IXUSR;
-      if ( p_access[4] == 'r' )
-        de.access |= S_IRGRP;
-      if ( p_access[5] == 'w' )
-        de.access |= S_IWGRP;
-      if ( p_access[6] == 'x' || p_access[6] == 's' )
-        de.access |= S_IXGRP;
-      if ( p_access[7] == 'r' )
-        de.access |= S_IROTH;
-      if ( p_access[8] == 'w' )
-        de.access |= S_IWOTH;
-      if ( p_access[9] == 'x' || p_access[9] == 't' )
-        de.access |= S_IXOTH;
-      if ( p_access[3] == 's' || p_access[3] == 'S' )
-        de.access |= S_ISUID;
-      if ( p_access[6] == 's' || p_access[6] == 'S' )
-        de.access |= S_ISGID;
-      if ( p_access[9] == 't' || p_access[9] == 'T' )
-        de.access |= S_ISVTX;
-
-      de.owner    = remoteEncoding()->decode(p_owner);
-      de.group    = remoteEncoding()->decode(p_group);
-      de.size     = charToLongLong(p_size);
-
-      // Parsing the date is somewhat tricky
-      // Examples : "Oct  6 22:49", "May 13  1999"
-
-      // First get current time - we need the current month and year
-      time_t currentTime = time( 0L );
-      struct tm * tmptr = gmtime( &currentTime );
-      int currentMonth = tmptr->tm_mon;
-      //qCDebug(KIO_FTPS) << "Current time :" << asctime( tmptr );
-      // Reset time fields
-      tmptr->tm_sec = 0;
-      tmptr->tm_min = 0;
-      tmptr->tm_hour = 0;
-      // Get day number (always second field)
-      tmptr->tm_mday = atoi( p_date_2 );
-      // Get month from first field
-      // NOTE : no, we don't want to use QLocale here
-      // It seems all FTP servers use the English way
-      //qCDebug(KIO_FTPS) << "Looking for month " << p_date_1;
-      static const char * s_months[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                                           "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-      for ( int c = 0 ; c < 12 ; c ++ )
-        if ( !strcmp( p_date_1, s_months[c]) )
-        {
-          //qCDebug(KIO_FTPS) << "Found month " << c << " for " << p_date_1;
-          tmptr->tm_mon = c;
-          break;
-        }
+  if ( *p == '/' ) // listing on ftp://ftp.gnupg.org/ starts with '/'
+    ++p;
 
-      // Parse third field
-      if ( strlen( p_date_3 ) == 4 ) // 4 digits, looks like a year
-        tmptr->tm_year = atoi( p_date_3 ) - 1900;
-      else
+  if (bFullPath)
+  {
+    for ( char* slash = nameEnd - 1; slash >= p; --slash )
+      if ( *slash == '/' )
       {
-        // otherwise, the year is implicit
-        // according to man ls, this happens when it is between than 6 months
-        // old and 1 hour in the future.
-        // So the year is : current year if tm_mon <= currentMonth+1
-        // otherwise current year minus one
-        // (The +1 is a security for the "+1 hour" at the end of the month issue)
-        if ( tmptr->tm_mon > currentMonth + 1 )
-          tmptr->tm_year--;
-
-        // and p_date_3 contains probably a time
-        char * semicolon;
-        if ( ( semicolon = (char*)strchr( p_date_3, ':' ) ) )
-        {
-          *semicolon = '\0';
-          tmptr->tm_min = atoi( semicolon + 1 );
-          tmptr->tm_hour = atoi( p_date_3 );
-        }
-        else
-          qCWarning(KIO_FTPS) << "Can't parse third field " << p_date_3;
+        p = slash + 1;
+        break;
       }
+  }
+  else if ( memchr( p, '/', nameEnd - p ) != 0 )
+    return false; // Don't trick us!
+  while ( p < nameEnd && isspace( (unsigned char)*p ) )
+    ++p;
+  while ( nameEnd > p && isspace( (unsigned char)nameEnd[-1] ) )
+    --nameEnd;
+  de.name = ftpDecodeListing( p, nameEnd - p );
+
+  de.type = S_IFREG;
+  switch ( p_access[0] ) {
+  case 'd':
+    de.type = S_IFDIR;
+    break;
+  case 's':
+    de.type = S_IFSOCK;
+    break;
+  case 'b':
+    de.type = S_IFBLK;
+    break;
+  case 'c':
+    de.type = S_IFCHR;
+    break;
+  case 'l':
+    de.type = S_IFREG;
+    // we don't set S_IFLNK here.  de.link says it.
+    break;
+  default:
+    break;
+  }
 
-      //qCDebug(KIO_FTPS) << asctime( tmptr );
-      de.date = mktime( tmptr );
-      return true;
+  if ( strlen( p_access ) >= 10 )
+  {
+    if ( p_access[1] == 'r' )
+      de.access |= S_IRUSR;
+    if ( p_access[2] == 'w' )
+      de.access |= S_IWUSR;
+    if ( p_access[3] == 'x' || p_access[3] == 's' )
+      de.access |= S_IXUSR;
+    if ( p_access[4] == 'r' )
+      de.access |= S_IRGRP;
+    if ( p_access[5] == 'w' )
+      de.access |= S_IWGRP;
+    if ( p_access[6] == 'x' || p_access[6] == 's' )
+      de.access |= S_IXGRP;
+    if ( p_access[7] == 'r' )
+      de.access |= S_IROTH;
+    if ( p_access[8] == 'w' )
+      de.access |= S_IWOTH;
+    if ( p_access[9] == 'x' || p_access[9] == 't' )
+      de.access |= S_IXOTH;
+    if ( p_access[3] == 's' || p_access[3] == 'S' )
+      de.access |= S_ISUID;
+    if ( p_access[6] == 's' || p_access[6] == 'S' )
+      de.access |= S_ISGID;
+    if ( p_access[9] == 't' || p_access[9] == 'T' )
+      de.access |= S_ISVTX;
+  }
+
+  de.owner    = ftpInternListing( p_owner, strlen( p_owner ) );
+  de.group    = p_group ? ftpInternListing( p_group, strlen( p_group ) ) : QString();
+  de.size     = charToLongLong(p_size);
+
+  // Parsing the date is somewhat tricky
+  // Examples : "Oct  6 22:49", "May 13  1999"
+  int day = ftpParseNumber( p_date_2 );
+  int month = ftpParseMonth( p_date_1 );
+  if ( month == 0 )
+    month = m_iListMonth;
+  int year = m_iListYear;
+  int hour = 0, minute = 0;
+
+  // Parse third field
+  if ( strlen( p_date_3 ) == 4 && isdigit( p_date_3[0] ) ) // 4 digits, looks like a year
+    year = ftpParseNumber( p_date_3 );
+  else
+  {
+    // otherwise, the year is implicit
+    // according to man ls, this happens when it is between than 6 months
+    // old and 1 hour in the future.
+    // So the year is : current year if month <= currentMonth+1
+    // otherwise current year minus one
+    // (The +1 is a security for the "+1 hour" at the end of the month issue)
+    if ( month > m_iListMonth + 1 )
+      year--;
+
+    // and p_date_3 contains probably a time
+    const char* colon = strchr( p_date_3, ':' );
+    if ( colon )
+    {
+      hour = ftpParseNumber( p_date_3 );
+      minute = ftpParseNumber( colon + 1 );
     }
-  } // line invalid, loop to get another line
-  return false;
+    else
+      qCWarning(KIO_FTPS) << "Can't parse third field " << p_date_3;
+  }
+
+  // The offset to UTC of the local time changes with DST, entries of the
+  // same hour share it
+  int iOffsetHour = ((year * 16 + month) * 32 + day) * 32 + hour;
+  if ( iOffsetHour != m_iListOffsetHour )
+  {
+    QDateTime local( QDate( year, month, day ), QTime( hour, 0 ), Qt::LocalTime );
+    if ( local.isValid() )
+      m_iListUtcOffset = local.offsetFromUtc();
+    m_iListOffsetHour = iOffsetHour;
+  }
+  de.date = ftpUtcTime( year, month, day, hour, minute, 0 ) - m_iListUtcOffset;
+  return true;
 }
 
 //===============================================================================
@@ -1825,13 +3266,17 @@ void Ftp::get( const QUrl & url )
 {
   qCDebug(KIO_FTPS) << "Ftp::get " << url.url();
   int iError = 0;
-  ftpGet(iError, -1, url, 0);               // iError gets status
+  StatusCode cs = ftpGet(iError, -1, url, 0);   // iError gets status
   if(iError)                                // can have only server side errs
      error(iError, url.path());
-  ftpCloseCommand();                        // must close command!
+  if(cs == statusSuccess)
+    ftpCloseCommand();                      // must close command!
+  else
+    ftpAbortTransfer();                     // the transfer may still run
 }
 
-Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fileoffset_t llOffset)
+Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fileoffset_t llOffset,
+                            bool bRestart)
 {
   // Calls error() by itself!
   if( !ftpOpenConnection(loginImplicit) )
@@ -1858,14 +3303,27 @@ Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fi
     qCDebug(KIO_FTPS) << "ftpGet: got offset from metadata : " << llOffset;
   }
 
-  if( !ftpOpenCommand("retr", url.path(), '?', ERR_CANNOT_OPEN_FOR_READING, llOffset) )
+  // the checksum covers the whole file, a resumed download adds the part
+  // that is there already. ASCII transfers change the data on the way.
+  QScopedPointer<FtpChecksum> checksum;
+  FtpChecksum::Algorithm algorithm = m_bTextMode ? FtpChecksum::None : ftpChecksumAlgorithm();
+  if(algorithm != FtpChecksum::None)
+  {
+    checksum.reset(new FtpChecksum(algorithm));
+    if(llOffset > 0 && (iCopyFile == -1 || !checksum->addFile(iCopyFile, llOffset)))
+      checksum.reset();
+  }
+
+  if( !ftpOpenCommand("retr", url.path(), '?', ERR_CANNOT_OPEN_FOR_READING, llOffset,
+                      ftpWantCompression(url.path()), bRestart) )
   {
     qCWarning(KIO_FTPS) << "ftpGet: Can't open for reading";
     return statusServerError;
   }
 
-  // Read the size from the response string
-  if(m_size == UnknownSize)
+  // Read the size from the response string, in MODE Z it may be the
+  // compressed one
+  if(m_size == UnknownSize && !m_zData)
   {
     const char* psz = strrchr( ftpResponse(4), '(' );
     if(psz) m_size = charToLongLong(psz+1);
@@ -1881,24 +3339,89 @@ Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fi
 
   QByteArray array;
   bool mimetypeEmitted = false;
-  char buffer[maximumIpcSize];
-  // start with small data chunks in case of a slow data source (modem)
-  // - unfortunately this has a negative impact on performance for large
-  // - files - so we will increase the block size after a while ...
+  // data() must not get more than maximumIpcSize at once, a local file can
+  // take much larger blocks
+  const int iMaxBlockSize = (iCopyFile == -1) ? int(maximumIpcSize) : 4 * 1024 * 1024;
+  QByteArray readBuffer;
+  readBuffer.resize(iMaxBlockSize);
+  char *buffer = readBuffer.data();
+  // Start with small data chunks in case of a slow data source, then read
+  // what arrives within one round trip at the rate measured so far, or what
+  // is waiting in the socket if that is more.
   int iBlockSize = initialIpcSize;
   int iBufferCur = 0;
+  qint64 rtt = m_iMinRtt > 0 ? m_iMinRtt : 10000;
+  QElapsedTimer rateTimer;
+  rateTimer.start();
+  TransferCalls calls;
+  bool bZeroCopy = (iCopyFile != -1) && !m_zData && !checksum && ftpZeroCopy();
+  bool bZeroCopied = false;
+  bool bCompressionProbed = false;
+  qint64 cpuStart = cpuTimeMs();
+
+  // the local file is written by another thread while we read on
+  QScopedPointer<FtpFileWriter> writer;
+  if(iCopyFile != -1 && !config()->readEntry("DisableWriterThread", false))
+  {
+    writer.reset(new FtpFileWriter(iCopyFile, 1024 * 1024, 8));
+    writer->start();
+  }
 
   while(m_size == UnknownSize || bytesLeft > 0)
-  {  // let the buffer size grow if the file is larger 64kByte ...
-    if(processed_size-llOffset > 1024 * 64)
-      iBlockSize = maximumIpcSize;
-
-    // read the data and detect EOF or error ...
-    if(iBlockSize+iBufferCur > (int)sizeof(buffer))
-      iBlockSize = sizeof(buffer) - iBufferCur;
-    if (m_data->bytesAvailable() == 0)
-      m_data->waitForReadyRead();
-    int n = m_data->read( buffer+iBufferCur, iBlockSize );
+  {
+    // get() or copy() stops the transfer with ABOR, the session stays
+    if(wasKilled())
+    {
+      qCDebug(KIO_FTPS) << "ftpGet: cancelled";
+      iError = ERR_USER_CANCELED;
+      return statusClientError;
+    }
+
+    // once the mimetype is known the rest can go straight to the file, what
+    // QSslSocket has buffered already goes first, see ftpSpliceToFile()
+    if(bZeroCopy && mimetypeEmitted && iBufferCur == 0)
+    {
+      bZeroCopy = false;
+      if(writer && (iError = writer->flush()) != 0)
+        return statusClientError;
+      int iRes = ftpSpliceToFile(iCopyFile, processed_size, bytesLeft);
+      if(iRes == 0)
+      {
+        bZeroCopied = true;
+        break;
+      }
+      if(iRes > 0)
+      {
+        iError = iRes;
+        return (iRes == ERR_COULD_NOT_READ) ? statusServerError : statusClientError;
+      }
+    }
+
+    int n;
+    if(m_zData)
+    { // inflate as much as the buffer takes, the stream ends with the file
+      ++calls.reads;
+      n = ftpInflateData(buffer+iBufferCur, iMaxBlockSize - iBufferCur);
+    }
+    else
+    {
+      // size the block by the bandwidth-delay product ...
+      qint64 elapsed = rateTimer.nsecsElapsed() / 1000;
+      qint64 bdp = elapsed > 0 ? (processed_size - llOffset) * rtt / elapsed : 0;
+      if (m_data->bytesAvailable() == 0)
+      {
+        ++calls.waits;
+        m_data->waitForReadyRead();
+      }
+      iBlockSize = qBound(qint64(initialIpcSize), qMax(bdp, m_data->bytesAvailable()),
+                          qint64(iMaxBlockSize));
+
+      // read the data and detect EOF or error ...
+      if(iBlockSize+iBufferCur > iMaxBlockSize)
+        iBlockSize = iMaxBlockSize - iBufferCur;
+      ++calls.reads;
+      n = m_data->read( buffer+iBufferCur, iBlockSize );
+    }
     if(n <= 0)
     {   // this is how we detect EOF in case of unknown size
       if( m_size == UnknownSize && n == 0 )
@@ -1916,6 +3439,7 @@ Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fi
       iBufferCur += n;
       if(iBufferCur < mimimumMimeSize && bytesLeft > 0)
       {
+        ++calls.ipc;
         processedSize( processed_size );
         continue;
       }
@@ -1936,19 +3460,108 @@ Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fi
         totalSize( m_size );
     }
 
+    if(checksum)
+      checksum->add(buffer, n);
+
     // write output file or pass to data pump ...
     if(iCopyFile == -1)
     {
+        ++calls.ipc;
         array = QByteArray::fromRawData(buffer, n);
         data( array );
         array.clear();
     }
-    else if( (iError = WriteToFile(iCopyFile, buffer, n)) != 0)
-       return statusClientError;              // client side error
+    else
+    {
+      ++calls.writes;
+      if( (iError = writer ? writer->write(buffer, n) : WriteToFile(iCopyFile, buffer, n)) != 0)
+        return statusClientError;              // client side error
+    }
+    ++calls.ipc;
     processedSize( processed_size );
+
+    // MODE can't change during a transfer, so a file that doesn't compress
+    // well is fetched again from here on uncompressed if enough is left
+    if(m_zData && !bCompressionProbed && m_zData->plainSize() >= compressionProbeSize)
+    {
+      bCompressionProbed = true;
+      if(!ftpKeepCompressing(url.path()) && m_size != UnknownSize && bytesLeft > KIO::filesize_t(compressionProbeSize))
+      {
+        ftpAbortTransfer();
+        if( !ftpOpenCommand("retr", url.path(), '?', ERR_CANNOT_OPEN_FOR_READING, processed_size,
+                            false, true) )
+        {
+          if( !m_bRestRefused )
+            return statusServerError;
+          // Without REST it is all over again from the start. A local file
+          // is written anew, what went to data() is read again and dropped.
+          ftpCloseCommand();
+          if( !ftpOpenCommand("retr", url.path(), '?', ERR_CANNOT_OPEN_FOR_READING, 0, false, true) )
+            return statusServerError;
+          if(iCopyFile != -1)
+          {
+            if(writer && (iError = writer->flush()) != 0)
+              return statusClientError;
+            if(ftruncate(iCopyFile, 0) == -1 || KDE_lseek(iCopyFile, 0, SEEK_SET) < 0)
+            {
+              iError = ERR_COULD_NOT_WRITE;
+              return statusClientError;
+            }
+            if(checksum)
+              checksum.reset(new FtpChecksum(algorithm));
+            llOffset = processed_size = 0;
+            bytesLeft = m_size;
+            processedSize( processed_size );
+          }
+          else
+          {
+            for(KIO::fileoffset_t skip = processed_size; skip > 0; )
+            {
+              if(m_data->bytesAvailable() == 0 && !m_data->waitForReadyRead())
+                n = 0;
+              else
+                n = m_data->read(buffer, int(qMin<KIO::fileoffset_t>(skip, iMaxBlockSize)));
+              if(n <= 0)
+              {
+                iError = ERR_COULD_NOT_READ;
+                return statusServerError;
+              }
+              skip -= n;
+            }
+          }
+        }
+        bZeroCopy = (iCopyFile != -1) && !checksum && ftpZeroCopy();
+      }
+    }
+  }
+
+  // the server should see the whole stream read, not the connection closed
+  // before its last bytes
+  if(m_zData)
+  {
+    char tail[256];
+    while(ftpInflateData(tail, sizeof(tail)) > 0) {}
   }
 
+  if(writer && (iError = writer->flush()) != 0)
+    return statusClientError;
+
   qCDebug(KIO_FTPS) << "ftpGet: done";
+  logCpuPerGiB("ftpGet", processed_size - llOffset, cpuStart, bZeroCopied);
+  calls.log("ftpGet", processed_size - llOffset);
+
+  // the server can only say its checksum once the transfer is closed
+  if(checksum)
+  {
+    ftpCloseCommand();
+    if(!ftpVerifyChecksum(*checksum, url.path()))
+    { // nothing of it can be trusted, not even to resume from
+      if(iCopyFile != -1 && ftruncate(iCopyFile, 0) == -1)
+        qCDebug(KIO_FTPS) << "ftpGet: cannot truncate the local file";
+      iError = ERR_COULD_NOT_READ;
+      return statusServerError;
+    }
+  }
   if(iCopyFile == -1)          // must signal EOF to data pump ...
     data(array);               // array is empty and must be empty!
 
@@ -1958,70 +3571,218 @@ Ftp::StatusCode Ftp::ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fi
   return statusSuccess;
 }
 
-#if 0
-  void Ftp::mimetype( const KUrl& url )
+void Ftp::mimetype( const QUrl& url )
+{
+  if( !ftpOpenConnection(loginImplicit) )
+    return;
+
+  // see ftpGet(), a directory has no data to look at
+  if ( !ftpSize( url.path(), 'I' ) && (m_iRespCode == 550) &&
+       ftpFolder(url.path(), false) )
   {
-    if( !ftpOpenConnection(loginImplicit) )
-          return;
+    mimeType( QStringLiteral("inode/directory") );
+    finished();
+    return;
+  }
 
-    if ( !ftpOpenCommand( "retr", url.path(), 'I', ERR_CANNOT_OPEN_FOR_READING, 0 ) ) {
-      qCWarning(KIO_FTPS) << "Can't open for reading";
+  // QMimeDatabase looks at no more than this of a local file either
+  const int iSniffSize = 16 * 1024;
+  QByteArray array( iSniffSize, '\0' );
+  int iSize = 0;
+  if( m_size != 0 )
+  {
+    if ( !ftpOpenCommand( "retr", url.path(), 'I', ERR_CANNOT_OPEN_FOR_READING ) )
+    {
+      qCWarning(KIO_FTPS) << "mimetype: Can't open for reading";
       return;
     }
-    char buffer[ 2048 ];
-    QByteArray array;
-    // Get one chunk of data only and send it, KIO::Job will determine the
-    // mimetype from it using KMimeMagic
-    int n = m_data->read( buffer, 2048 );
-    array.setRawData(buffer, n);
-    data( array );
-    array.resetRawData(buffer, n);
+    while( iSize < iSniffSize && !wasKilled() )
+    {
+      int n;
+      if( m_zData )
+        n = ftpInflateData( array.data() + iSize, iSniffSize - iSize );
+      else
+      {
+        if( m_data->bytesAvailable() <= 0 && !m_data->waitForReadyRead() )
+          break;                    // a small file is over
+        n = m_data->read( array.data() + iSize, iSniffSize - iSize );
+      }
+      if( n <= 0 )
+        break;
+      iSize += n;
+    }
+    ftpAbortTransfer();             // the rest isn't needed
+  }
+  array.resize( iSize );
 
-    qCDebug(KIO_FTPS) << "aborting";
-    ftpAbortTransfer();
+  QMimeType mime = QMimeDatabase().mimeTypeForFileNameAndData( url.fileName(), array );
+  qCDebug(KIO_FTPS) << "mimetype: Emitting" << mime.name() << "after" << iSize << "bytes";
+  mimeType( mime.name() );
+  finished();
+}
 
-    qCDebug(KIO_FTPS) << "finished";
-    finished();
-    qCDebug(KIO_FTPS) << "after finished";
-  }
-
-  void Ftp::ftpAbortTransfer()
-  {
-    // RFC 959, page 34-35
-    // IAC (interpret as command) = 255 ; IP (interrupt process) = 254
-    // DM = 242 (data mark)
-     char msg[4];
-     // 1. User system inserts the Telnet "Interrupt Process" (IP) signal
-     //   in the Telnet stream.
-     msg[0] = (char) 255; //IAC
-     msg[1] = (char) 254; //IP
-     (void) send(sControl, msg, 2, 0);
-     // 2. User system sends the Telnet "Sync" signal.
-     msg[0] = (char) 255; //IAC
-     msg[1] = (char) 242; //DM
-     if (send(sControl, msg, 2, MSG_OOB) != 2)
-       ; // error...
-
-     // Send ABOR
-     qCDebug(KIO_FTPS) << "send ABOR";
-     QCString buf = "ABOR\r\n";
-     if ( KSocks::self()->write( sControl, buf.data(), buf.length() ) <= 0 )  {
-       error( ERR_COULD_NOT_WRITE, QString() );
-       return;
-     }
+bool Ftp::ftpZeroCopy()
+{
+#ifdef Q_OS_LINUX
+  // Qt runs TLS on its own buffers and does not hand out the session keys,
+  // so the kernel can only take over data connections in the clear
+  return m_data && m_data->mode() == QSslSocket::UnencryptedMode && m_dataProtection != protPrivate &&
+         config()->readEntry("ZeroCopyTransfers", false);
+#else
+  return false;
+#endif
+}
 
-     //
-     qCDebug(KIO_FTPS) << "read resp";
-     if ( readresp() != '2' )
-     {
-       error( ERR_COULD_NOT_READ, QString() );
-       return;
-     }
+int Ftp::ftpSpliceToFile(int iCopyFile, KIO::fileoffset_t& processed_size, KIO::filesize_t& bytesLeft)
+{
+#ifdef Q_OS_LINUX
+  int fdSocket = m_data->socketDescriptor();
+  int fdPipe[2];
+  if(fdSocket == -1 || pipe2(fdPipe, O_CLOEXEC) == -1)
+    return -1;
+  const int iChunk = 1024 * 1024;
+  fcntl(fdPipe[1], F_SETPIPE_SZ, iChunk);     // may fail, the default will do
+
+  // what QSslSocket read already comes before what is still in the socket
+  int iRes = 0;
+  bool bMoved = false;
+  while(m_data->bytesAvailable() > 0 && (m_size == UnknownSize || bytesLeft > 0))
+  {
+    char buffer[maximumIpcSize];
+    qint64 want = qMin(m_data->bytesAvailable(), qint64(sizeof(buffer)));
+    if(m_size != UnknownSize && bytesLeft < KIO::filesize_t(want))
+      want = bytesLeft;
+    qint64 n = m_data->read(buffer, want);
+    if(n <= 0)
+      break;
+    if((iRes = WriteToFile(iCopyFile, buffer, n)) != 0)
+    {
+      ::close(fdPipe[0]);
+      ::close(fdPipe[1]);
+      return iRes;
+    }
+    bMoved = true;
+    processed_size += n;
+    if(m_size != UnknownSize)
+      bytesLeft -= n;
+  }
+
+  while(m_size == UnknownSize || bytesLeft > 0)
+  {
+    size_t want = iChunk;
+    if(m_size != UnknownSize && bytesLeft < want)
+      want = bytesLeft;
+    ssize_t n = splice(fdSocket, NULL, fdPipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n == 0)
+    { // this is how we detect EOF in case of unknown size
+      if(m_size != UnknownSize)
+        iRes = ERR_COULD_NOT_READ;
+      break;
+    }
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN)
+      {
+        struct pollfd pfd = { fdSocket, POLLIN, 0 };
+        if(poll(&pfd, 1, readTimeout() * 1000) > 0)
+          continue;
+        iRes = ERR_COULD_NOT_READ;
+      }
+      else if(!bMoved && (errno == EINVAL || errno == ENOSYS))
+        iRes = -1;
+      else
+        iRes = ERR_COULD_NOT_READ;
+      break;
+    }
+
+    while(n > 0)
+    {
+      ssize_t written = splice(fdPipe[0], NULL, iCopyFile, NULL, n, SPLICE_F_MOVE);
+      if(written < 0 && errno == EINTR)
+        continue;
+      if(written < 0 && (errno == EINVAL || errno == ENOSYS))
+      { // the file system does not take spliced pages, use the pipe like a buffer
+        char buffer[maximumIpcSize];
+        written = read(fdPipe[0], buffer, qMin(size_t(n), sizeof(buffer)));
+        if(written > 0 && (iRes = WriteToFile(iCopyFile, buffer, written)) != 0)
+          break;
+      }
+      if(written <= 0)
+      {
+        iRes = (errno == ENOSPC) ? ERR_DISK_FULL : ERR_COULD_NOT_WRITE;
+        break;
+      }
+      n -= written;
+      processed_size += written;
+      if(m_size != UnknownSize)
+        bytesLeft -= written;
+    }
+    if(iRes != 0)
+      break;
+    bMoved = true;
+    processedSize(processed_size);
+  }
 
-    qCDebug(KIO_FTPS) << "close sockets";
-    closeSockets();
+  ::close(fdPipe[0]);
+  ::close(fdPipe[1]);
+  qCDebug(KIO_FTPS) << "ftpSpliceToFile: result " << iRes << " at " << processed_size;
+  return iRes;
+#else
+  Q_UNUSED(iCopyFile);
+  Q_UNUSED(processed_size);
+  Q_UNUSED(bytesLeft);
+  return -1;
+#endif
+}
+
+int Ftp::ftpSendFile(int iCopyFile, KIO::fileoffset_t& processed_size)
+{
+#ifdef Q_OS_LINUX
+  // nothing may still wait in QSslSocket's write buffer
+  int fdSocket = m_data->socketDescriptor();
+  if(fdSocket == -1 || m_data->bytesToWrite() > 0)
+    return -1;
+
+  int iRes = 0;
+  bool bMoved = false;
+  for(;;)
+  {
+    ssize_t n = sendfile(fdSocket, iCopyFile, NULL, 1024 * 1024);
+    if(n == 0)                                // end of the file
+      break;
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN)
+      {
+        struct pollfd pfd = { fdSocket, POLLOUT, 0 };
+        if(poll(&pfd, 1, readTimeout() * 1000) > 0)
+          continue;
+        iRes = ERR_COULD_NOT_WRITE;
+      }
+      else if(!bMoved && (errno == EINVAL || errno == ENOSYS))
+        iRes = -1;
+      else if(errno == EPIPE || errno == ECONNRESET)
+        iRes = ERR_CONNECTION_BROKEN;
+      else
+        iRes = ERR_COULD_NOT_WRITE;
+      break;
+    }
+    bMoved = true;
+    processed_size += n;
+    processedSize(processed_size);
   }
+  qCDebug(KIO_FTPS) << "ftpSendFile: result " << iRes << " at " << processed_size;
+  return iRes;
+#else
+  Q_UNUSED(iCopyFile);
+  Q_UNUSED(processed_size);
+  return -1;
 #endif
+}
 
 //===============================================================================
 // public: put           upload file to server
@@ -2043,6 +3804,8 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
   if( !ftpOpenConnection(loginImplicit) )
     return statusServerError;
 
+  ftpInvalidateListing( dest_url.path(), false );
+
   // Don't use mark partial over anonymous FTP.
   // My incoming dir allows put but not rename...
   bool bMarkPartial;
@@ -2055,7 +3818,19 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
   QString dest_part( dest_orig );
   dest_part += ".part";
 
-  if ( ftpSize( dest_orig, 'I' ) )
+  // Ask for the size of the destination and of its ".part" file at once,
+  // the answers are evaluated one after the other below
+  QByteArray sizeOrig = "SIZE ";
+  sizeOrig += remoteEncoding()->encode(dest_orig);
+  QByteArray sizePart = "SIZE ";
+  sizePart += remoteEncoding()->encode(dest_part);
+  ftpDataMode('I', true);
+  ftpQueueCmd( sizeOrig );
+  if ( bMarkPartial )
+    ftpQueueCmd( sizePart );
+  ftpFlushCmdQueue();
+
+  if ( ftpSizeResponse( sizeOrig ) )
   {
     if ( m_size == 0 )
     { // delete files with zero size
@@ -2083,7 +3858,7 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
     // Don't chmod an existing file
     permissions = -1;
   }
-  else if ( bMarkPartial && ftpSize( dest_part, 'I' ) )
+  else if ( bMarkPartial && ftpSizeResponse( sizePart ) )
   { // file with extension .part exists
     if ( m_size == 0 )
     {  // delete files with zero size
@@ -2125,6 +3900,8 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
     offset = m_size;
     if(iCopyFile != -1)
     {
+      // STOR after REST overwrites from there, no need to cut the remote file
+      offset = ftpVerifyResume( dest, iCopyFile, offset, true );
       if( KDE_lseek(iCopyFile, offset, SEEK_SET) < 0 )
       {
         iError = ERR_CANNOT_RESUME;
@@ -2133,28 +3910,73 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
     }
   }
 
-  if (! ftpOpenCommand( "stor", dest, '?', ERR_COULD_NOT_WRITE, offset ) )
+  // see ftpGet(), a resumed upload adds the part the server has from the file
+  QScopedPointer<FtpChecksum> checksum;
+  FtpChecksum::Algorithm algorithm = m_bTextMode ? FtpChecksum::None : ftpChecksumAlgorithm();
+  if ( algorithm != FtpChecksum::None )
+  {
+    checksum.reset( new FtpChecksum( algorithm ) );
+    if ( offset > 0 && (iCopyFile == -1 || !checksum->addFile( iCopyFile, offset )) )
+      checksum.reset();
+  }
+
+  if (! ftpOpenCommand( "stor", dest, '?', ERR_COULD_NOT_WRITE, offset,
+                         ftpWantCompression( dest_orig ) ) )
      return statusServerError;
 
   qCDebug(KIO_FTPS) << "ftpPut: starting with offset=" << offset;
   KIO::fileoffset_t processed_size = offset;
 
   QByteArray buffer;
-  int result;
+  QByteArray compressed;
+  int result = 1;
   int iBlockSize = initialIpcSize;
+  // Without an event loop QSslSocket only sends in its wait calls. Each
+  // write is followed by one that doesn't block and hands the kernel what
+  // it takes right now, so the next read of the file overlaps with the
+  // sending. Only above iHighWater waiting bytes do we block until they
+  // are below it again.
+  const qint64 iHighWater = 4 * 1024 * 1024;
+  const qint64 iMaxBlock = iHighWater / 2;
+  bool bZeroCopied = false;
+  bool bCompressionProbed = false;
+  qint64 cpuStart = cpuTimeMs();
+
+  // a local file can go to the data connection without passing user space
+  if(iCopyFile != -1 && !m_zData && !checksum && ftpZeroCopy())
+  {
+    int iRes = ftpSendFile(iCopyFile, processed_size);
+    if(iRes >= 0)
+    {
+      iError = iRes;
+      result = iRes ? -1 : 0;
+      bZeroCopied = true;
+    }
+  }
+
   // Loop until we got 'dataEnd'
-  do
+  TransferCalls calls;
+  while ( result > 0 )
   {
+    if ( wasKilled() )
+    {
+      qCDebug(KIO_FTPS) << "ftpPut: cancelled";
+      iError = ERR_USER_CANCELED;
+      result = -1;
+      break;
+    }
     if(iCopyFile == -1)
     {
+      calls.ipc += 2;
       dataReq(); // Request for data
       result = readData( buffer );
     }
     else
-    { // let the buffer size grow if the file is larger 64kByte ...
-      if(processed_size-offset > 1024 * 64)
-        iBlockSize = maximumIpcSize;
+    { // read what fits below the high-water mark, in reasonable pieces
+      iBlockSize = qBound(qint64(maximumIpcSize), iHighWater - m_data->bytesToWrite(),
+                          iMaxBlock);
       buffer.resize(iBlockSize);
+      ++calls.reads;
       result = ::read(iCopyFile, buffer.data(), buffer.size());
       if(result < 0)
         iError = ERR_COULD_NOT_WRITE;
@@ -2164,17 +3986,97 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
 
     if (result > 0)
     {
-      m_data->write( buffer );
-      while (m_data->bytesToWrite() && m_data->waitForBytesWritten()) {}
+      if ( checksum )
+        checksum->add( buffer.constData(), result );
+      if ( m_zData )
+      {
+        compressed.resize( 0 );
+        if ( !m_zData->deflate( buffer, compressed ) )
+        {
+          iError = ERR_COULD_NOT_WRITE;
+          result = -1;
+          break;
+        }
+      }
+      const QByteArray& out = m_zData ? compressed : buffer;
+      ++calls.writes;
+      if ( m_data->write( out ) != out.size() )
+      {
+        iError = ERR_COULD_NOT_WRITE;
+        result = -1;
+        break;
+      }
+      m_data->waitForBytesWritten( 0 );
+      while (m_data->bytesToWrite() > iHighWater)
+      {
+        ++calls.waits;
+        if ( !m_data->waitForBytesWritten() )
+          break;
+      }
       processed_size += result;
+      ++calls.ipc;
       processedSize (processed_size);
     }
-  }
-  while ( result > 0 );
 
-  if (result != 0) // error
+    // A file that doesn't compress well goes on uncompressed: the server
+    // keeps what it got as a complete upload and we resume it in MODE S.
+    // Data from the application may end any time, only a local file is
+    // worth it. Should the resume fail, what is left behind must be the
+    // .part file and not a truncated original, so without MarkPartial the
+    // file is finished in MODE Z and only the next one is sent plain.
+    if ( result > 0 && m_zData && !bCompressionProbed && m_zData->plainSize() >= compressionProbeSize )
+    {
+      bCompressionProbed = true;
+      if ( !ftpKeepCompressing( dest_orig ) && iCopyFile != -1 && bMarkPartial )
+      {
+        compressed.resize( 0 );
+        if ( !m_zData->deflate( QByteArray(), compressed, true ) ||
+             m_data->write( compressed ) != compressed.size() )
+        {
+          iError = ERR_COULD_NOT_WRITE;
+          result = -1;
+          break;
+        }
+        while (m_data->bytesToWrite() && m_data->waitForBytesWritten()) {}
+        if ( !ftpCloseCommand() )
+        {
+          iError = ERR_COULD_NOT_WRITE;
+          return statusServerError;
+        }
+        if ( !ftpOpenCommand( "stor", dest, '?', ERR_COULD_NOT_WRITE, processed_size ) )
+          return statusServerError;
+      }
+    }
+  }
+
+  // the end of the compressed stream goes last
+  if ( result == 0 && m_zData )
+  {
+    compressed.resize( 0 );
+    if ( !m_zData->deflate( QByteArray(), compressed, true ) ||
+         m_data->write( compressed ) != compressed.size() )
+    {
+      iError = ERR_COULD_NOT_WRITE;
+      result = -1;
+    }
+  }
+
+  // everything must be on the wire before the data connection is closed
+  if ( result == 0 )
   {
-    ftpCloseCommand();               // don't care about errors
+    while (m_data->bytesToWrite() && m_data->waitForBytesWritten()) {}
+    if ( m_data->bytesToWrite() )
+    {
+      iError = ERR_COULD_NOT_WRITE;
+      result = -1;
+    }
+  }
+  logCpuPerGiB("ftpPut", processed_size - offset, cpuStart, bZeroCopied);
+  calls.log("ftpPut", processed_size - offset);
+
+  if (result != 0) // error
+  {
+    ftpAbortTransfer();
     qCDebug(KIO_FTPS) << "Error during 'put'. Aborting.";
     if (bMarkPartial)
     {
@@ -2196,6 +4098,20 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
     return statusServerError;
   }
 
+  // A .part file that doesn't match is of no use, not even to resume.
+  // Without MarkPartial dest is the user's file, it is left alone.
+  if ( checksum && !ftpVerifyChecksum( *checksum, dest ) )
+  {
+    if ( bMarkPartial )
+    {
+      QByteArray cmd = "DELE ";
+      cmd += remoteEncoding()->encode(dest);
+      (void) ftpSendCmd( cmd );
+    }
+    iError = ERR_COULD_NOT_WRITE;
+    return statusServerError;
+  }
+
   // after full download rename the file back to original name
   if ( bMarkPartial )
   {
@@ -2231,14 +4147,26 @@ Ftp::StatusCode Ftp::ftpPut(int& iError, int iCopyFile, const QUrl& dest_url,
     Warning : the size depends on the transfer mode, hence the second arg. */
 bool Ftp::ftpSize( const QString & path, char mode )
 {
-  m_size = UnknownSize;
-  if( !ftpDataMode(mode) )
-      return false;
-
+  // a TYPE command, if required, goes out together with SIZE
+  bool bTypeQueued = ftpDataMode(mode, true);
   QByteArray buf;
   buf = "SIZE ";
   buf += remoteEncoding()->encode(path);
-  if( !ftpSendCmd( buf ) || (m_iRespType != 2) )
+  ftpQueueCmd( buf );
+  ftpFlushCmdQueue();
+
+  if( bTypeQueued && ftpUseResponse("TYPE") && (m_iRespType != 2) )
+  {
+    m_size = UnknownSize;
+    return false;
+  }
+  return ftpSizeResponse( buf );
+}
+
+bool Ftp::ftpSizeResponse( const QByteArray& cmd )
+{
+  m_size = UnknownSize;
+  if( !ftpUseResponse( cmd ) || (m_iRespType != 2) )
     return false;
 
   // skip leading "213 " (response code)
@@ -2257,7 +4185,7 @@ bool Ftp::ftpSize( const QString & path, char mode )
 // more important.
 // Theoretically "list" could return different results in ASCII
 // and BINARY mode. But again, most servers ignore ASCII here.
-bool Ftp::ftpDataMode(char cMode)
+bool Ftp::ftpDataMode(char cMode, bool bQueue)
 {
   if(cMode == '?') cMode = m_bTextMode ? 'A' : 'I';
   else if(cMode == 'a') cMode = 'A';
@@ -2265,10 +4193,15 @@ bool Ftp::ftpDataMode(char cMode)
 
   qCDebug(KIO_FTPS) << "ftpDataMode: want '" << cMode << "' has '" << m_cDataMode << "'";
   if(m_cDataMode == cMode)
-    return true;
+    return !bQueue;
 
   QByteArray buf = "TYPE ";
   buf += cMode;
+  if( bQueue )
+  {
+    ftpQueueCmd(buf);               // m_cDataMode is set by ftpRecordResponse
+    return true;
+  }
   if( !ftpSendCmd(buf) || (m_iRespType != 2) )
       return false;
   m_cDataMode = cMode;
@@ -2276,6 +4209,166 @@ bool Ftp::ftpDataMode(char cMode)
 }
 
 
+/**
+ * Returns the lower case suffix of the file name in @p path, used to tell
+ * files that don't compress, see Ftp::ftpKeepCompressing()
+ */
+static QString ftpFileSuffix(const QString& path)
+{
+  QString name = path.mid(path.lastIndexOf('/') + 1);
+  int i = name.lastIndexOf('.');
+  return (i > 0) ? name.mid(i + 1).toLower() : QString();
+}
+
+void Ftp::ftpTransferMode(bool bCompress)
+{
+  bCompress = bCompress && (m_extControl & modeZSupported);
+  if(m_bModeZ == bCompress)
+    return;
+  ftpQueueCmd(bCompress ? "MODE Z" : "MODE S");  // m_bModeZ is set by ftpRecordResponse
+}
+
+bool Ftp::ftpWantCompression(const QString& path)
+{
+  // pointless over a fast network, so only on request
+  if(!(m_extControl & modeZSupported) || !config()->readEntry("CompressedTransfers", false))
+    return false;
+  return path.isEmpty() || !m_noCompress.contains(ftpFileSuffix(path));
+}
+
+bool Ftp::ftpKeepCompressing(const QString& path)
+{
+  qint64 iElapsedUs = qMax<qint64>(m_zData->elapsedUs(), 1);
+  double ratio = double(m_zData->compressedSize()) / qMax<qint64>(m_zData->plainSize(), 1);
+  double zlibShare = double(m_zData->zlibUs()) / iElapsedUs;
+  qCDebug(KIO_FTPS) << "MODE Z:" << path << m_zData->plainSize() * 1000000.0 / iElapsedUs / (1024 * 1024)
+                    << "MiB/s, ratio" << ratio << ", zlib" << int(zlibShare * 100) << "% of the time";
+
+  // Saving less than a tenth isn't worth it, and a zlib that takes most of
+  // the time is what holds the transfer up.
+  if(ratio < 0.9 && zlibShare < 0.5)
+    return true;
+  qCDebug(KIO_FTPS) << "MODE Z: not compressing files like" << path << "any more";
+  m_noCompress.insert(ftpFileSuffix(path));
+  return false;
+}
+
+int Ftp::ftpInflateData(char* buf, int len)
+{
+  while(!m_zData->atEnd())
+  {
+    if(!m_zData->needsInput())
+    {
+      int n = m_zData->inflate(buf, len);
+      if(n != 0)
+        return n;
+      if(!m_zData->needsInput() && !m_zData->atEnd())
+        return -1;
+      continue;
+    }
+    // the data connection must not end before the stream does
+    if(m_data->bytesAvailable() <= 0 && !m_data->waitForReadyRead())
+      return -1;
+    m_zData->feed(m_data->read(qMax<qint64>(m_data->bytesAvailable(), 64 * 1024)));
+  }
+  return 0;
+}
+
+/**
+ * Takes the checksum from the reply @p text (after the code) to HASH,
+ * 'SHA-256 0-1023 <hex> file', or to XCRC and XSHA256, '<hex> ...'. The
+ * checksum is the 3rd or the 1st token, any other place could be a file
+ * name that looks like one. CRC32 may come without its leading zeros.
+ */
+static QByteArray ftpParseChecksum(const char* text, bool bHash, int iHexLen)
+{
+  QList<QByteArray> tokens = QByteArray(text).simplified().split(' ');
+  int iToken = bHash ? 2 : 0;
+  if(iToken >= tokens.size())
+    return QByteArray();
+  const QByteArray& token = tokens[iToken];
+  if(token.isEmpty() || token.size() > iHexLen || (iHexLen > 8 && token.size() != iHexLen))
+    return QByteArray();
+  for(int i = 0; i < token.size(); ++i)
+    if(!isxdigit(uchar(token[i])))
+      return QByteArray();
+  return token.toLower().rightJustified(iHexLen, '0');
+}
+
+FtpChecksum::Algorithm Ftp::ftpChecksumAlgorithm()
+{
+  if(!config()->readEntry("VerifyTransfers", false))
+    return FtpChecksum::None;
+  // CRC32 costs the least per byte and catches what goes wrong on the way
+  if(m_extControl & (hashCrc32 | xcrcSupported))
+    return FtpChecksum::Crc32;
+  if(m_extControl & (hashSha256 | xsha256Supported))
+    return FtpChecksum::Sha256;
+  return FtpChecksum::None;
+}
+
+bool Ftp::ftpRemoteChecksum(const QString& path, FtpChecksum::Algorithm algorithm, QByteArray& sum)
+{
+  bool bCrc = (algorithm == FtpChecksum::Crc32);
+  QByteArray cmd;
+  if(m_extControl & (bCrc ? hashCrc32 : hashSha256))
+  {
+    if(!ftpSendCmd(bCrc ? "OPTS HASH CRC32" : "OPTS HASH SHA-256") || m_iRespType != 2)
+      return false;
+    cmd = "HASH ";
+  }
+  else
+    cmd = bCrc ? "XCRC " : "XSHA256 ";
+  cmd += remoteEncoding()->encode(path);
+  if(!ftpSendLongCmd(cmd) || m_iRespType != 2)
+    return false;
+  sum = ftpParseChecksum(ftpResponse(4), cmd.startsWith("HASH "), bCrc ? 8 : 64);
+  return !sum.isEmpty();
+}
+
+bool Ftp::ftpVerifyChecksum(const FtpChecksum& checksum, const QString& path)
+{
+  qint64 iElapsedUs = qMax<qint64>(checksum.elapsedUs(), 1);
+  qCDebug(KIO_FTPS) << checksum.name() << ":" << checksum.size() << "bytes at"
+                    << checksum.size() * 1000000.0 / iElapsedUs / (1024 * 1024) << "MiB/s";
+
+  QByteArray local = checksum.result();
+  QByteArray remote;
+  setMetaData(QStringLiteral("checksum-type"), QString::fromLatin1(checksum.name()));
+  setMetaData(QStringLiteral("checksum"), QString::fromLatin1(local));
+  if(!ftpRemoteChecksum(path, checksum.algorithm(), remote))
+  {
+    qCDebug(KIO_FTPS) << "no" << checksum.name() << "from the server for" << path;
+    return true;
+  }
+  setMetaData(QStringLiteral("checksum-server"), QString::fromLatin1(remote));
+  if(remote == local)
+    return true;
+  qCWarning(KIO_FTPS) << checksum.name() << "of" << path << "is" << local << "here but" << remote
+                      << "on the server";
+  return false;
+}
+
+bool Ftp::ftpSendLongCmd(const QByteArray& cmd)
+{
+  // queued commands must go first, their replies come before ours
+  if(!ftpFlushCmdQueue())
+    return false;
+  qCDebug(KIO_FTPS) << "send> " << cmd.data();
+  m_control->write(cmd + "\r\n");
+  while(m_control->bytesToWrite() && m_control->waitForBytesWritten()) {}
+  while(!m_control->canReadLine() && m_control->state() == QAbstractSocket::ConnectedState)
+  {
+    if(wasKilled())
+      return false;
+    m_control->waitForReadyRead(1000);
+  }
+  if(!m_control->canReadLine())
+    return false;                  // the connection is gone
+  ftpResponse(-1);
+  return true;
+}
+
 bool Ftp::ftpFolder(const QString& path, bool bReportError)
 {
   QString newPath = path;
@@ -2329,6 +4422,12 @@ void Ftp::copy( const QUrl &src, const QUrl &dest, int permissions, KIO::JobFlag
     cs = ftpCopyGet(iError, iCopyFile, sCopyFile, src, permissions, flags);
     if( cs == statusServerError ) sCopyFile = src.url();
   }
+  else if(!bSrcLocal && !bDestLocal)             // Ftp -> Ftp
+  {
+    qCDebug(KIO_FTPS) << "Ftp::copy ftp '" << src.toDisplayString() << "' -> ftp '" << dest.toDisplayString() << "'";
+    cs = ftpCopyServerSide(iError, src, dest, permissions, flags);
+    sCopyFile = (cs == statusClientError) ? dest.url() : src.url();
+  }
   else {
     error( ERR_UNSUPPORTED_ACTION, QString() );
     return;
@@ -2339,10 +4438,88 @@ void Ftp::copy( const QUrl &src, const QUrl &dest, int permissions, KIO::JobFlag
     ::close(iCopyFile);
   if(iError)
     error(iError, sCopyFile);
-  ftpCloseCommand();                        // must close command!
+  if(cs == statusSuccess)
+    ftpCloseCommand();                      // must close command!
+  else
+    ftpAbortTransfer();                     // the transfer may still run
 }
 
 
+Ftp::StatusCode Ftp::ftpCopyServerSide(int& iError, const QUrl& src, const QUrl& dest,
+                                       int permissions, KIO::JobFlags flags)
+{
+  iError = ERR_UNSUPPORTED_ACTION;
+  if( (m_extControl & siteCopyUnknown) || src.host() != dest.host() ||
+      src.port() != dest.port() || src.userName() != dest.userName() )
+    return statusServerError;
+  if( !ftpOpenConnection(loginImplicit) )
+  {
+    iError = 0;                 // ftpOpenConnection() said why
+    return statusServerError;
+  }
+  if( src.host() != m_host )
+    return statusServerError;
+
+  QString srcPath = src.path();
+  QString destPath = dest.path();
+  if( !(flags & KIO::Overwrite) && ftpSize( destPath, 'I' ) )
+  {
+    iError = ERR_FILE_ALREADY_EXIST;
+    return statusClientError;
+  }
+  KIO::filesize_t size = ftpSize( srcPath, 'I' ) ? m_size : UnknownSize;
+  if( size != UnknownSize )
+    totalSize( size );
+
+  QByteArray cmd = "SITE CPFR ";
+  cmd += remoteEncoding()->encode( srcPath );
+  if( !ftpSendCmd( cmd ) )
+  {
+    iError = ERR_CONNECTION_BROKEN;
+    return statusServerError;
+  }
+  // 202 and 501 are what some servers answer to SITE commands they don't know
+  if( m_iRespCode == 500 || m_iRespCode == 501 || m_iRespCode == 502 || m_iRespCode == 504 ||
+      m_iRespCode == 202 )
+  {
+    m_extControl |= siteCopyUnknown;
+    qCDebug(KIO_FTPS) << "ftpCopyServerSide: SITE CPFR not supported - disabling";
+    return statusServerError;
+  }
+  if( m_iRespType != 3 )
+  {
+    iError = ERR_CANNOT_OPEN_FOR_READING;
+    return statusServerError;
+  }
+
+  // From here on the server does the copy, a failure is a real one.
+  // The reply to CPTO only comes when the copy is done, which takes longer
+  // than ftpSendCmd() waits for a big file
+  cmd = "SITE CPTO ";
+  cmd += remoteEncoding()->encode( destPath );
+  ftpInvalidateListing( destPath, false );
+  if( !ftpSendLongCmd( cmd ) )
+  {
+    iError = wasKilled() ? ERR_USER_CANCELED : ERR_CONNECTION_BROKEN;
+    return statusClientError;
+  }
+  if( m_iRespType != 2 )
+  {
+    qCDebug(KIO_FTPS) << "ftpCopyServerSide: SITE CPTO failed with" << m_iRespCode;
+    iError = ERR_COULD_NOT_WRITE;
+    return statusClientError;
+  }
+
+  if( size != UnknownSize )
+    processedSize( size );
+  // set final permissions, see ftpPut()
+  if( permissions != -1 )
+    (void) ftpChmod( destPath, permissions );
+  iError = 0;
+  finished();
+  return statusSuccess;
+}
+
 Ftp::StatusCode Ftp::ftpCopyPut(int& iError, int& iCopyFile, const QString &sCopyFile,
                                 const QUrl& url, int permissions, KIO::JobFlags flags)
 {
@@ -2402,9 +4579,11 @@ Ftp::StatusCode Ftp::ftpCopyGet(int& iError, int& iCopyFile, const QString &sCop
 
   // do we have a ".part" file?
   QByteArray sPart = QFile::encodeName(sCopyFile + ".part");
+  QString sStateFile = sCopyFile + ".part.segments";     // see ftpGetSegmented()
   bool bResume = false;
   bool bPartExists = (KDE_stat( sPart.data(), &buff ) != -1);
   bool bMarkPartial = config()->readEntry("MarkPartial", true);
+  bool bPartial = false;
   if(bMarkPartial && bPartExists && buff.st_size > 0)
   { // must not be a folder! please fix a similar bug in kio_file!!
     if(S_ISDIR(buff.st_mode))
@@ -2412,16 +4591,24 @@ Ftp::StatusCode Ftp::ftpCopyGet(int& iError, int& iCopyFile, const QString &sCop
       iError = ERR_DIR_ALREADY_EXIST;
       return statusClientError;                            // client side error
     }
-    //doesn't work for copy? -> design flaw?
-#ifdef  ENABLE_CAN_RESUME
-    bResume = canResume( buff.st_size );
-#else
-    bResume = true;
-#endif
+    bPartial = true;
   }
 
-  if(bPartExists && !bResume)                  // get rid of an unwanted ".part" file
-    remove(sPart.data());
+  // large files are fetched in parallel segments, see ftpGetSegmented()
+  bool bSegmented = false;
+  qlonglong hSegmentThreshold = config()->readEntry("SegmentedDownloadThreshold", qlonglong(0));
+  if(hSegmentThreshold > 0 && metaData("resume").isEmpty())
+  {
+    if( !ftpOpenConnection(loginImplicit) )
+      return statusServerError;
+    // The segments are neither checksummed nor checked by ftpVerifyResume(),
+    // a single stream does both. A resume of segments is one then from the
+    // head that is complete.
+    bSegmented = !m_bTextMode && !m_bUseProxy && ftpSize(url.path(), 'I') &&
+                 m_size != UnknownSize && m_size >= KIO::filesize_t(hSegmentThreshold) &&
+                 ftpChecksumAlgorithm() == FtpChecksum::None &&
+                 !(bPartial && config()->readEntry("VerifyResume", true));
+  }
 
   // JPF: in kio_file overwrite disables ".part" operations. I do not believe
   // JPF: that this is a good behaviour!
@@ -2438,19 +4625,80 @@ Ftp::StatusCode Ftp::ftpCopyGet(int& iError, int& iCopyFile, const QString &sCop
 
   // open the output file ...
   KIO::fileoffset_t hCopyOffset = 0;
-  if(bResume)
+  if(bPartial)
   {
     iCopyFile = KDE_open( sPart.data(), O_RDWR );  // append if resuming
-    hCopyOffset = KDE_lseek(iCopyFile, 0, SEEK_END);
+    hCopyOffset = (iCopyFile == -1) ? -1 : KDE_lseek(iCopyFile, 0, SEEK_END);
     if(hCopyOffset < 0)
     {
       iError = ERR_CANNOT_RESUME;
       return statusClientError;                            // client side error
     }
-    qCDebug(KIO_FTPS) << "copy: resuming at " << hCopyOffset;
+    // A segmented download may have left holes. Segments resume each on
+    // their own, a single stream only from the complete head.
+    QList<FtpSegment> segments;
+    if(ftpLoadSegments(sStateFile, hCopyOffset, segments))
+    {
+      if(bSegmented)
+      {
+        hCopyOffset = 0;
+        for(int i = 0; i < segments.size(); ++i)
+          hCopyOffset += segments[i].done;
+      }
+      else
+      {
+        hCopyOffset = ftpSegmentsHead(segments);
+        if(ftruncate(iCopyFile, hCopyOffset) == -1 || KDE_lseek(iCopyFile, hCopyOffset, SEEK_SET) < 0)
+        {
+          iError = ERR_CANNOT_RESUME;
+          return statusClientError;
+        }
+        QFile::remove(sStateFile);
+      }
+    }
+    else if(bSegmented)               // ftpGetSegmented() starts over
+      hCopyOffset = 0;
+    // whatever doesn't match the remote file goes, see ftpVerifyResume()
+    if(!bSegmented && hCopyOffset > 0)
+    {
+      if( !ftpOpenConnection(loginImplicit) )
+        return statusServerError;
+      KIO::fileoffset_t hVerified = ftpVerifyResume(url.path(), iCopyFile, hCopyOffset, false);
+      if(hVerified != hCopyOffset)
+      {
+        if(ftruncate(iCopyFile, hVerified) == -1 || KDE_lseek(iCopyFile, hVerified, SEEK_SET) < 0)
+        {
+          iError = ERR_CANNOT_RESUME;
+          return statusClientError;
+        }
+        hCopyOffset = hVerified;
+      }
+    }
+
+    // only now it is known where the copy would resume
+    //doesn't work for copy? -> design flaw?
+#ifdef  ENABLE_CAN_RESUME
+    bResume = hCopyOffset > 0 && canResume( hCopyOffset );
+#else
+    bResume = hCopyOffset > 0;
+#endif
+    if(bResume)
+      qCDebug(KIO_FTPS) << "copy: resuming at " << hCopyOffset;
+    else
+    {
+      ::close(iCopyFile);
+      iCopyFile = -1;
+      hCopyOffset = 0;
+    }
+  }
+
+  if(bPartExists && !bResume)                  // get rid of an unwanted ".part" file
+    remove(sPart.data());
+  if(!bResume)
+  { // the mimetype of a segmented download is read back from the file
+    QFile::remove(sStateFile);
+    iCopyFile = KDE_open(sPart.data(), O_CREAT | O_TRUNC | (bSegmented ? O_RDWR : O_WRONLY), initialMode);
   }
-  else
-    iCopyFile = KDE_open(sPart.data(), O_CREAT | O_TRUNC | O_WRONLY, initialMode);
 
   if(iCopyFile == -1)
   {
@@ -2461,7 +4709,8 @@ Ftp::StatusCode Ftp::ftpCopyGet(int& iError, int& iCopyFile, const QString &sCop
   }
 
   // delegate the real work (iError gets status) ...
-  StatusCode iRes = ftpGet(iError, iCopyFile, url, hCopyOffset);
+  StatusCode iRes = bSegmented ? ftpGetSegmented(iError, iCopyFile, url, sStateFile)
+                               : ftpGet(iError, iCopyFile, url, hCopyOffset);
   if( ::close(iCopyFile) && iRes == statusSuccess )
   {
     iError = ERR_COULD_NOT_WRITE;
@@ -2490,19 +4739,909 @@ Ftp::StatusCode Ftp::ftpCopyGet(int& iError, int& iCopyFile, const QString &sCop
     { // should a very small ".part" be deleted?
       int size = config()->readEntry("MinimumKeepSize", DEFAULT_MINIMUM_KEEP_SIZE);
       if (buff.st_size <  size)
+      {
         remove(sPart.data());
+        QFile::remove(sStateFile);
+      }
     }
   }
   return iRes;
 }
 
-void SslServer::incomingConnection(qintptr socketDescriptor)
+/**
+ * Reads @p len bytes of the remote file @p path at @p offset over
+ * @p session and aborts the transfer then
+ */
+static bool ftpReadRemote(FtpSession& session, const QByteArray& path, KIO::fileoffset_t offset,
+                          int len, int timeout, QByteArray& data)
 {
-     QSslSocket *m_socket = new QSslSocket;
-     if (!m_socket->setSocketDescriptor(socketDescriptor)) delete m_socket; //{
-         //connect(m_socket, SIGNAL(encrypted()), this, SLOT(ready()));
-     //    //serverSocket->startServerEncryption();
-     //} else {
-     //    delete serverSocket;
-     //}
- }
+  data.clear();
+  if(!session.openData("RETR " + path, offset))
+    return false;
+  QSslSocket *sock = session.data();
+  while(data.size() < len && (sock->bytesAvailable() > 0 || sock->waitForReadyRead(timeout)))
+    data += sock->read(len - data.size());
+  session.abortData();
+  return data.size() == len;
+}
+
+KIO::fileoffset_t Ftp::ftpVerifyResume(const QString& path, int fd, KIO::fileoffset_t offset,
+                                       bool bUpload)
+{
+  if(offset <= 0 || !config()->readEntry("VerifyResume", true))
+    return offset;
+
+  // A partial file longer than what it is a copy of belongs to another
+  // version. Times aren't compared, the clocks of both sides may differ.
+  KIO::filesize_t hComplete = UnknownSize;
+  if(bUpload)
+  {
+    KDE_struct_stat buff;
+    if(KDE_fstat(fd, &buff) == 0)
+      hComplete = buff.st_size;
+  }
+  else
+  {
+    KIO::filesize_t hSize = m_size;
+    if(ftpSize(path, 'I'))
+      hComplete = m_size;
+    m_size = hSize;
+  }
+  if(hComplete != UnknownSize && hComplete < KIO::filesize_t(offset))
+  {
+    qCDebug(KIO_FTPS) << "ftpVerifyResume:" << path << "is shorter than the partial copy, starting over";
+    return 0;
+  }
+
+  // Compare the whole window right before the offset. If anything in it
+  // differs, step back to the window before it, each four times as large
+  // as the one before up to 4 MiB, and resume at the end of the first one
+  // that matches: the data right before the resume point is always known
+  // to be good. The server's copy is read on a connection of its own, the
+  // transfer of the file needs this one.
+  // A FtpSession doesn't go through the proxy.
+  if(m_bUseProxy)
+  {
+    qCDebug(KIO_FTPS) << "ftpVerifyResume: can't check, behind a proxy";
+    return offset;
+  }
+  FtpSession::Params params = ftpSessionParams();
+  FtpSession session(params);
+  if(!session.open())
+  {
+    qCDebug(KIO_FTPS) << "ftpVerifyResume: can't check, no second connection";
+    return offset;
+  }
+  const int iBlock = 64 * 1024;
+  QByteArray encoded = remoteEncoding()->encode(path);
+  QByteArray local;
+  QByteArray remote;
+  KIO::fileoffset_t result = 0;
+  KIO::fileoffset_t end = offset;
+  for(int iStep = 0; iStep < 8 && end > 0; ++iStep)
+  {
+    int len = int(qMin<KIO::fileoffset_t>(iBlock << (2 * qMin(iStep, 3)), end));
+    KIO::fileoffset_t start = end - len;
+    if(!ftpReadRemote(session, encoded, start, len, params.readTimeout, remote))
+    { // can't tell, the end is trusted as before but nothing else
+      result = (iStep == 0) ? offset : 0;
+      break;
+    }
+    local.resize(len);
+    if(pread(fd, local.data(), len, start) == len && memcmp(local.constData(), remote.constData(), len) == 0)
+    {
+      result = end;
+      break;
+    }
+    end = start;
+  }
+  session.close();
+  if(result != offset)
+    qCDebug(KIO_FTPS) << "ftpVerifyResume:" << path << "differs before" << offset << ", resuming at" << result;
+  return result;
+}
+
+Ftp::StatusCode Ftp::ftpGetSegmented(int& iError, int iCopyFile, const QUrl& url,
+                                     const QString& sStateFile)
+{
+  const KIO::filesize_t size = m_size;
+  QList<FtpSegment> segments;
+  if( ftpLoadSegments(sStateFile, size, segments) )
+    qCDebug(KIO_FTPS) << "ftpGetSegmented: resuming " << segments.size() << " segments";
+  else
+  { // a file without state may have holes anywhere, it starts over
+    if(ftruncate(iCopyFile, 0) == -1)
+    {
+      iError = ERR_COULD_NOT_WRITE;
+      return statusClientError;
+    }
+    int iCount = qBound(1, config()->readEntry("SegmentedDownloadConnections", 4), 16);
+    KIO::fileoffset_t hLength = (size + iCount - 1) / iCount;
+    for(KIO::fileoffset_t start = 0; KIO::filesize_t(start) < size; start += hLength)
+    {
+      FtpSegment segment = { start, qMin(start + hLength, KIO::fileoffset_t(size)), 0 };
+      segments.append(segment);
+    }
+  }
+
+  // The state goes first: once the file has its full size, only the state
+  // tells what of it is there. The workers write all over the file, give it
+  // its final size then.
+  ftpSaveSegments(sStateFile, size, segments);
+  if(ftruncate(iCopyFile, size) == -1)
+  {
+    iError = (errno == ENOSPC) ? ERR_DISK_FULL : ERR_COULD_NOT_WRITE;
+    return statusClientError;
+  }
+
+  QList<FtpSegmentThread*> threads;
+  QList<int> pending;
+  for(int i = 0; i < segments.size(); ++i)
+  {
+    threads.append(NULL);
+    if(segments[i].start + KIO::fileoffset_t(segments[i].done) < segments[i].end)
+      pending.append(i);
+  }
+  qCDebug(KIO_FTPS) << "ftpGetSegmented: " << pending.size() << " of " << segments.size()
+                    << " segments to fetch, size=" << size;
+
+  const FtpSession::Params params = ftpSessionParams();
+  const QByteArray path = remoteEncoding()->encode(url.path());
+  int iMaxRunning = pending.size();
+  int iRunning = 0;
+  bool bSingleStream = false;
+  bool bMimetypeEmitted = false;
+  StatusCode iRes = statusSuccess;
+  QElapsedTimer saveTimer;
+  saveTimer.start();
+
+  for(;;)
+  {
+    while(iRes == statusSuccess && !pending.isEmpty() && iRunning < iMaxRunning)
+    {
+      int i = pending.takeFirst();
+      threads[i] = new FtpSegmentThread(params, path, size, iCopyFile, segments[i]);
+      threads[i]->start();
+      ++iRunning;
+    }
+    if(iRunning == 0)
+      break;
+
+    // sleep until a worker is done, but not longer than a progress update
+    for(int i = 0; i < threads.size(); ++i)
+      if(threads[i])
+      {
+        threads[i]->wait(200);
+        break;
+      }
+
+    KIO::filesize_t hProcessed = 0;
+    for(int i = 0; i < threads.size(); ++i)
+    {
+      FtpSegmentThread* thread = threads[i];
+      if(thread)
+        segments[i].done = thread->done();
+      hProcessed += segments[i].done;
+      if(!thread || !thread->isFinished())
+        continue;
+
+      threads[i] = NULL;
+      --iRunning;
+      if(thread->error() == 0)
+        ;
+      else if(thread->failedEarly() && iRes == statusSuccess)
+      { // the server has no connection to spare: run fewer workers, and once
+        // none is left fetch the rest over our own connection
+        qCDebug(KIO_FTPS) << "ftpGetSegmented: no connection for segment " << i
+                          << ", error " << thread->error();
+        pending.append(i);
+        iMaxRunning = qMax(iRunning, 1);
+        if(iRunning == 0)
+          bSingleStream = true;
+      }
+      else if(iRes == statusSuccess)
+      {
+        iError = thread->error();
+        iRes = thread->clientError() ? statusClientError : statusServerError;
+      }
+      delete thread;
+    }
+    processedSize(hProcessed);
+
+    if(iRes == statusSuccess && wasKilled())
+    {
+      iError = ERR_USER_CANCELED;
+      iRes = statusClientError;
+    }
+    if(iRes != statusSuccess)
+      for(int i = 0; i < threads.size(); ++i)
+        if(threads[i])
+          threads[i]->stop();
+
+    if(bSingleStream)
+      break;
+
+    // get the mime type from the head of the file and set the total size ...
+    if(!bMimetypeEmitted && segments[0].start == 0 &&
+       (segments[0].done >= mimimumMimeSize || KIO::fileoffset_t(segments[0].done) == segments[0].end))
+    {
+      char buffer[mimimumMimeSize];
+      ssize_t n = pread(iCopyFile, buffer, qMin(segments[0].done, KIO::filesize_t(sizeof(buffer))), 0);
+      if(n >= 0)
+      {
+        bMimetypeEmitted = true;
+        QMimeType mime = QMimeDatabase().mimeTypeForFileNameAndData(url.fileName(),
+                                                                    QByteArray::fromRawData(buffer, n));
+        qCDebug(KIO_FTPS) << "ftpGetSegmented: Emitting mimetype " << mime.name();
+        mimeType( mime.name() );
+        totalSize( size );
+      }
+    }
+
+    if(saveTimer.elapsed() > 2000)
+    {
+      ftpSaveSegments(sStateFile, size, segments);
+      saveTimer.restart();
+    }
+  }
+
+  if(iRes != statusSuccess)
+  {
+    ftpSaveSegments(sStateFile, size, segments);
+    return iRes;
+  }
+
+  if(bSingleStream)
+  { // like a resume of the segments, see ftpCopyGet()
+    KIO::fileoffset_t hOffset = ftpSegmentsHead(segments);
+    qCDebug(KIO_FTPS) << "ftpGetSegmented: no second connection, a single stream from " << hOffset;
+    if(ftruncate(iCopyFile, hOffset) == -1 || KDE_lseek(iCopyFile, hOffset, SEEK_SET) < 0)
+    {
+      iError = ERR_COULD_NOT_WRITE;
+      return statusClientError;
+    }
+    QFile::remove(sStateFile);
+    return ftpGet(iError, iCopyFile, url, hOffset, true);
+  }
+
+  QFile::remove(sStateFile);
+  qCDebug(KIO_FTPS) << "ftpGetSegmented: done";
+  processedSize( size );
+  finished();
+  return statusSuccess;
+}
+
+bool Ftp::ftpLoadSegments(const QString& sStateFile, KIO::filesize_t size,
+                          QList<FtpSegment>& segments)
+{
+  segments.clear();
+  if( !QFile::exists(sStateFile) )
+    return false;
+
+  KConfig state( sStateFile, KConfig::SimpleConfig );
+  KConfigGroup group = state.group( "Segments" );
+  if( group.readEntry("Size", qlonglong(-1)) != qlonglong(size) )
+    return false;
+
+  int iCount = group.readEntry("Count", 0);
+  for(int i = 0; i < iCount; ++i)
+  {
+    QStringList values = group.readEntry(QString::fromLatin1("Segment%1").arg(i), QString()).split(',');
+    FtpSegment segment = { 0, 0, 0 };
+    if(values.size() == 3)
+    {
+      segment.start = values[0].toLongLong();
+      segment.end = values[1].toLongLong();
+      segment.done = values[2].toULongLong();
+    }
+    if(segment.start < 0 || segment.end <= segment.start || KIO::filesize_t(segment.end) > size ||
+       KIO::fileoffset_t(segment.done) > segment.end - segment.start)
+    {
+      qCWarning(KIO_FTPS) << "ignoring broken segment state " << sStateFile;
+      segments.clear();
+      return false;
+    }
+    segments.append(segment);
+  }
+  return !segments.isEmpty();
+}
+
+void Ftp::ftpSaveSegments(const QString& sStateFile, KIO::filesize_t size,
+                          const QList<FtpSegment>& segments)
+{
+  KConfig state( sStateFile, KConfig::SimpleConfig );
+  KConfigGroup group = state.group( "Segments" );
+  group.writeEntry( "Size", qlonglong(size) );
+  group.writeEntry( "Count", segments.size() );
+  for(int i = 0; i < segments.size(); ++i)
+    group.writeEntry( QString::fromLatin1("Segment%1").arg(i),
+                      QString::fromLatin1("%1,%2,%3").arg(segments[i].start)
+                        .arg(segments[i].end).arg(segments[i].done) );
+  state.sync();
+}
+
+KIO::fileoffset_t Ftp::ftpSegmentsHead(const QList<FtpSegment>& segments)
+{
+  KIO::fileoffset_t head = 0;
+  for(int i = 0; i < segments.size() && segments[i].start == head; ++i)
+  {
+    head += segments[i].done;
+    if(head < segments[i].end)
+      break;
+  }
+  return head;
+}
+
+FtpSession::Params Ftp::ftpSessionParams()
+{
+  FtpSession::Params params;
+  params.host = m_host;
+  params.port = m_port > 0 ? m_port : DEFAULT_FTP_PORT;
+  params.user = m_loginUser;
+  params.pass = m_loginPass;
+  params.ignoreSslErrors = m_bIgnoreSslErrors;
+  params.protectData = (m_dataProtection == protPrivate);
+  params.preferEpsv = (m_dataConnMode == dataConnEpsv);
+  params.connectTimeout = connectTimeout() * 1000;
+  params.readTimeout = readTimeout() * 1000;
+  if(m_control)
+    params.sessionTicket = m_control->sslConfiguration().sessionTicket();
+  return params;
+}
+
+void SslServer::incomingConnection(qintptr socketDescriptor)
+{
+     QSslSocket *m_socket = new QSslSocket;
+     if (!m_socket->setSocketDescriptor(socketDescriptor)) delete m_socket; //{
+         //connect(m_socket, SIGNAL(encrypted()), this, SLOT(ready()));
+     //    //serverSocket->startServerEncryption();
+     //} else {
+     //    delete serverSocket;
+     //}
+ }
+
+//===============================================================================
+// FtpSession
+//===============================================================================
+FtpSession::FtpSession( const Params& params )
+  : m_params(params), m_control(NULL), m_data(NULL), m_iRespCode(0), m_iError(0), m_bBusy(false)
+{
+}
+
+FtpSession::~FtpSession()
+{
+  close();
+}
+
+bool FtpSession::open()
+{
+  m_control = new QSslSocket();
+#ifndef QT_NO_NETWORKPROXY
+  m_control->setProxy(QNetworkProxy::DefaultProxy);
+#endif
+  m_control->connectToHost(m_params.host, m_params.port);
+
+  m_iError = ERR_COULD_NOT_CONNECT;
+  if ( !m_control->waitForConnected(m_params.connectTimeout) ||
+       !readResponse(m_params.readTimeout) || respType() != 2 )
+    return false;
+  if ( !sendCmd("AUTH TLS") || m_iRespCode != 234 )
+    return false;
+
+  // nobody can be asked about certificate problems here, the user already
+  // decided when the main connection was opened
+  if ( m_params.ignoreSslErrors )
+    m_control->ignoreSslErrors();
+  QSslConfiguration sslConfig = m_control->sslConfiguration();
+  sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+  if ( !m_params.sessionTicket.isEmpty() )
+    sslConfig.setSessionTicket(m_params.sessionTicket);
+  m_control->setSslConfiguration(sslConfig);
+  m_control->startClientEncryption();
+  if ( !m_control->waitForEncrypted(m_params.connectTimeout) )
+    return false;
+
+  m_iError = ERR_COULD_NOT_LOGIN;
+  if ( !sendCmd("USER " + m_params.user.toLatin1()) )
+    return false;
+  if ( m_iRespCode == 331 && !sendCmd("PASS " + m_params.pass.toLatin1()) )
+    return false;
+  if ( m_iRespCode != 230 )
+    return false;
+
+  if ( m_params.protectData &&
+       ( !sendCmd("PBSZ 0") || respType() != 2 || !sendCmd("PROT P") || respType() != 2 ) )
+  {
+    m_iError = ERR_COULD_NOT_CONNECT;
+    return false;
+  }
+
+  m_iError = 0;
+  return true;
+}
+
+void FtpSession::close()
+{
+  if ( m_bBusy )
+    abortData();
+  delete m_data;
+  m_data = NULL;
+
+  if ( m_control && m_control->state() == QAbstractSocket::ConnectedState )
+  { // no need to wait for the answer
+    m_control->write("QUIT\r\n");
+    m_control->waitForBytesWritten(m_params.readTimeout);
+  }
+  delete m_control;
+  m_control = NULL;
+}
+
+bool FtpSession::sendCmd( const QByteArray& cmd )
+{
+  if ( cmd.startsWith("PASS ") )
+    qCDebug(KIO_FTPS) << "session " << m_params.host << " cmd> PASS [protected]";
+  else
+    qCDebug(KIO_FTPS) << "session " << m_params.host << " cmd> " << cmd;
+
+  QByteArray buf = cmd;
+  buf += "\r\n";
+  m_iRespCode = 0;
+  if ( m_control->write(buf) != buf.size() )
+    return false;
+  while (m_control->bytesToWrite() && m_control->waitForBytesWritten(m_params.readTimeout)) {}
+  return readResponse(m_params.readTimeout);
+}
+
+/**
+ * Reads a response like Ftp::ftpResponse() does, but gives up after
+ * @p timeout milliseconds without data.
+ */
+bool FtpSession::readResponse( int timeout )
+{
+  int iMore = 0;
+  m_iRespCode = 0;
+  do {
+    while ( !m_control->canReadLine() )
+      if ( !m_control->waitForReadyRead(timeout) )
+        return false;
+    m_lastLine = m_control->readLine();
+    const char *pTxt = m_lastLine.constData();
+    int nBytes = m_lastLine.size();
+    int iCode  = atoi(pTxt);
+    if(iCode > 0) m_iRespCode = iCode;
+
+    if(iMore != 0)
+    {
+      if(nBytes == 0)
+        m_iRespCode = iMore = 0;
+      else if(iCode == iMore && nBytes >= 4 && pTxt[3] != '-')
+        iMore = 0;
+    }
+    else if(nBytes < 4 || iCode < 100)
+      iMore = 0;
+    else if(pTxt[3] == '-')
+      iMore = iCode;
+  } while(iMore != 0);
+  qCDebug(KIO_FTPS) << "session " << m_params.host << " resp> " << m_lastLine.trimmed();
+  return m_iRespCode > 0;
+}
+
+const char* FtpSession::response( int iOffset ) const
+{
+  const char *pTxt = m_lastLine.constData();
+  while(iOffset-- > 0 && pTxt[0])
+    pTxt++;
+  return pTxt;
+}
+
+bool FtpSession::openData( const QByteArray& cmd, KIO::fileoffset_t offset )
+{
+  assert(m_control != NULL);
+  assert(m_data == NULL);
+
+  // same order as Ftp::ftpOpenDataConnection(), PASV only works for IPv4
+  QHostAddress addr = m_control->peerAddress();
+  bool bIPv4 = (addr.protocol() == QAbstractSocket::IPv4Protocol);
+  bool bEpsvFirst = m_params.preferEpsv || !bIPv4;
+  quint16 port = 0;
+  bool bOk = false;
+  for (int iAttempt = 0; iAttempt < 2 && !bOk; ++iAttempt)
+  {
+    if ( (iAttempt == 0) == bEpsvFirst )
+      bOk = sendCmd("EPSV") && respType() == 2 && ftpParseEpsvReply(response(3), port);
+    else if ( bIPv4 )
+      bOk = sendCmd("PASV") && respType() == 2 && ftpParsePasvReply(response(3), port);
+  }
+
+  m_iError = ERR_COULD_NOT_CONNECT;
+  if ( !bOk )
+    return false;
+
+  m_data = new QSslSocket();
+#ifndef QT_NO_NETWORKPROXY
+  m_data->setProxy(QNetworkProxy::DefaultProxy);
+#endif
+  m_data->connectToHost(addr, port);
+  if ( !m_data->waitForConnected(m_params.connectTimeout) )
+    return false;
+
+  if ( offset > 0 && ( !sendCmd("REST " + QByteArray::number(qlonglong(offset))) || respType() != 3 ) )
+  {
+    m_iError = ERR_CANNOT_RESUME;
+    return false;
+  }
+  if ( !sendCmd(cmd) || respType() != 1 )
+  {
+    m_iError = ERR_CANNOT_OPEN_FOR_READING;
+    return false;
+  }
+  m_bBusy = true;
+
+  if ( m_params.protectData )
+  {
+    if ( m_params.ignoreSslErrors )
+      m_data->ignoreSslErrors();
+    QSslConfiguration sslConfig = m_data->sslConfiguration();
+    QByteArray session = m_control->sslConfiguration().sessionTicket();
+    sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if ( !session.isEmpty() )
+      sslConfig.setSessionTicket(session);
+    m_data->setSslConfiguration(sslConfig);
+    m_data->startClientEncryption();
+    if ( !m_data->waitForEncrypted(m_params.connectTimeout) )
+      return false;
+  }
+
+  m_iError = 0;
+  return true;
+}
+
+bool FtpSession::closeData()
+{
+  delete m_data;
+  m_data = NULL;
+  if ( !m_bBusy )
+    return true;
+  m_bBusy = false;
+  return readResponse(m_params.readTimeout) && respType() == 2;
+}
+
+void FtpSession::abortData()
+{
+  // drop the data connection first, a server blocked in send() notices
+  // that sooner than the ABOR
+  delete m_data;
+  m_data = NULL;
+  if ( !m_bBusy )
+    return;
+  m_bBusy = false;
+
+  // the transfer gets 426 and the ABOR 226, or just 226 if the transfer
+  // was complete anyway
+  m_control->write("ABOR\r\n");
+  if ( readResponse(m_params.readTimeout) && respType() == 4 )
+    readResponse(m_params.readTimeout);
+}
+
+//===============================================================================
+// FtpFileWriter
+//===============================================================================
+FtpFileWriter::FtpFileWriter( int fd, int iBufferSize, int iBufferCount )
+  : m_fd(fd), m_iBufferSize(iBufferSize), m_buffers(iBufferCount, NULL), m_used(iBufferCount, 0),
+    m_iHead(0), m_iTail(0), m_iQueued(0), m_iError(0), m_bQuit(false)
+{
+  // page aligned buffers keep the kernel from splitting pages on copy
+  for (int i = 0; i < m_buffers.size(); ++i)
+  {
+    void *p = NULL;
+    if (posix_memalign(&p, 4096, m_iBufferSize) != 0)
+      p = malloc(m_iBufferSize);
+    m_buffers[i] = static_cast<char*>(p);
+  }
+}
+
+FtpFileWriter::~FtpFileWriter()
+{
+  flush();
+  m_mutex.lock();
+  m_bQuit = true;
+  m_changed.wakeAll();
+  m_mutex.unlock();
+  wait();
+  for (int i = 0; i < m_buffers.size(); ++i)
+    free(m_buffers[i]);
+}
+
+int FtpFileWriter::write( const char* buf, int len )
+{
+  while (len > 0)
+  {
+    // the head buffer is ours as long as not all of them are queued
+    m_mutex.lock();
+    while (m_iQueued == m_buffers.size())
+      m_changed.wait(&m_mutex);
+    int iError = m_iError;
+    m_mutex.unlock();
+    if (iError != 0)
+      return iError;
+
+    int n = qMin(len, m_iBufferSize - m_used[m_iHead]);
+    memcpy(m_buffers[m_iHead] + m_used[m_iHead], buf, n);
+    m_used[m_iHead] += n;
+    buf += n;
+    len -= n;
+    if (m_used[m_iHead] == m_iBufferSize)
+      queueHead();
+  }
+  return 0;
+}
+
+void FtpFileWriter::queueHead()
+{
+  QMutexLocker locker(&m_mutex);
+  ++m_iQueued;
+  m_iHead = (m_iHead + 1) % m_buffers.size();
+  m_changed.wakeAll();
+}
+
+int FtpFileWriter::flush()
+{
+  if (m_used[m_iHead] > 0)
+  {
+    m_mutex.lock();
+    while (m_iQueued == m_buffers.size())
+      m_changed.wait(&m_mutex);
+    m_mutex.unlock();
+    queueHead();
+  }
+
+  QMutexLocker locker(&m_mutex);
+  while (m_iQueued > 0)
+    m_changed.wait(&m_mutex);
+  return m_iError;
+}
+
+void FtpFileWriter::run()
+{
+  QMutexLocker locker(&m_mutex);
+  for (;;)
+  {
+    while (m_iQueued == 0 && !m_bQuit)
+      m_changed.wait(&m_mutex);
+    if (m_iQueued == 0)
+      return;
+
+    // after an error the buffers are only recycled, write() reports it
+    int i = m_iTail;
+    bool bWrite = (m_iError == 0);
+    locker.unlock();
+    int iError = bWrite ? KIO::WriteToFile(m_fd, m_buffers[i], m_used[i]) : 0;
+    locker.relock();
+
+    if (iError != 0)
+      m_iError = iError;
+    m_used[i] = 0;
+    m_iTail = (m_iTail + 1) % m_buffers.size();
+    --m_iQueued;
+    m_changed.wakeAll();
+  }
+}
+
+//===============================================================================
+// FtpSegmentThread
+//===============================================================================
+FtpSegmentThread::FtpSegmentThread( const FtpSession::Params& params, const QByteArray& path,
+                                    KIO::filesize_t fileSize, int fd, const FtpSegment& segment )
+  : m_params(params), m_path(path), m_fileSize(fileSize), m_fd(fd), m_segment(segment),
+    m_done(segment.done), m_bStop(0), m_iError(0), m_bClientError(false), m_bFailedEarly(false)
+{
+}
+
+void FtpSegmentThread::run()
+{
+  FtpSession session(m_params);
+  if ( !session.open() )
+  {
+    m_iError = session.error();
+    m_bFailedEarly = true;
+    return;
+  }
+
+  KIO::fileoffset_t pos = m_segment.start + m_segment.done;
+  if ( !session.sendCmd("TYPE I") || session.respType() != 2 ||
+       !session.openData("RETR " + m_path, pos) )
+  {
+    // 421 (too many connections) and 425 (no data connection) are worth
+    // another try once the other workers are done
+    m_iError = session.error() ? session.error() : ERR_COULD_NOT_CONNECT;
+    m_bFailedEarly = (session.respType() == 4 || session.respType() == 0);
+    return;
+  }
+
+  QSslSocket *data = session.data();
+  char buffer[64 * 1024];
+  int iIdle = 0;
+  while ( pos < m_segment.end && !m_bStop.load() )
+  {
+    if ( data->bytesAvailable() == 0 )
+    { // wake up now and then to notice stop()
+      if ( !data->waitForReadyRead(200) )
+      {
+        iIdle += 200;
+        if ( data->state() != QAbstractSocket::ConnectedState || iIdle >= m_params.readTimeout )
+        {
+          m_iError = ERR_COULD_NOT_READ;
+          break;
+        }
+        continue;
+      }
+      iIdle = 0;
+    }
+
+    qint64 n = data->read( buffer, qMin(qint64(sizeof(buffer)), qint64(m_segment.end - pos)) );
+    if ( n < 0 )
+    {
+      m_iError = ERR_COULD_NOT_READ;
+      break;
+    }
+    if ( (m_iError = KIO::PWriteToFile(m_fd, buffer, n, pos)) != 0 )
+    {
+      m_bClientError = true;
+      break;
+    }
+    pos += n;
+    m_done.store(pos - m_segment.start);
+  }
+
+  // the last segment ends with the file, all others are cut off at their
+  // boundary so the server does not send what another worker fetches
+  if ( m_iError == 0 && KIO::filesize_t(pos) == m_fileSize )
+  {
+    if ( !session.closeData() )
+      qCDebug(KIO_FTPS) << "segment at " << m_segment.start << ": no transfer complete message";
+  }
+  else
+    session.abortData();
+}
+
+//===============================================================================
+// FtpZStream
+//===============================================================================
+FtpZStream::FtpZStream( bool bDeflate )
+  : m_iInputPos(0), m_bDeflate(bDeflate), m_bEnd(false), m_iZlibNs(0)
+{
+  memset( &m_stream, 0, sizeof(m_stream) );
+  // the fastest level, a slow deflate would hold up the data connection
+  if ( bDeflate )
+    m_bValid = (deflateInit( &m_stream, Z_BEST_SPEED ) == Z_OK);
+  else
+    m_bValid = (inflateInit( &m_stream ) == Z_OK);
+  m_started.start();
+}
+
+FtpZStream::~FtpZStream()
+{
+  if ( !m_bValid )
+    return;
+  if ( m_bDeflate )
+    deflateEnd( &m_stream );
+  else
+    inflateEnd( &m_stream );
+}
+
+void FtpZStream::feed( const QByteArray& data )
+{
+  if ( needsInput() )
+    m_input = data;
+  else
+  {
+    m_input.remove( 0, m_iInputPos );
+    m_input += data;
+  }
+  m_iInputPos = 0;
+}
+
+int FtpZStream::inflate( char* buf, int len )
+{
+  if ( !m_bValid )
+    return -1;
+  if ( m_bEnd )
+    return 0;
+
+  QElapsedTimer timer;
+  timer.start();
+  m_stream.next_in = reinterpret_cast<Bytef*>( m_input.data() + m_iInputPos );
+  m_stream.avail_in = m_input.size() - m_iInputPos;
+  m_stream.next_out = reinterpret_cast<Bytef*>( buf );
+  m_stream.avail_out = len;
+  int iRes = ::inflate( &m_stream, Z_NO_FLUSH );
+  m_iInputPos = m_input.size() - m_stream.avail_in;
+  m_iZlibNs += timer.nsecsElapsed();
+
+  if ( iRes == Z_STREAM_END )
+    m_bEnd = true;
+  else if ( iRes != Z_OK && iRes != Z_BUF_ERROR )
+    return -1;
+  return len - m_stream.avail_out;
+}
+
+bool FtpZStream::deflate( const QByteArray& data, QByteArray& out, bool bFinish )
+{
+  if ( !m_bValid || m_bEnd )
+    return false;
+
+  QElapsedTimer timer;
+  timer.start();
+  const int iChunk = 64 * 1024;
+  m_stream.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( data.constData() ) );
+  m_stream.avail_in = data.size();
+  int iRes;
+  do
+  {
+    int iOld = out.size();
+    out.resize( iOld + iChunk );
+    m_stream.next_out = reinterpret_cast<Bytef*>( out.data() + iOld );
+    m_stream.avail_out = iChunk;
+    iRes = ::deflate( &m_stream, bFinish ? Z_FINISH : Z_NO_FLUSH );
+    out.resize( iOld + iChunk - m_stream.avail_out );
+  } while ( bFinish ? (iRes == Z_OK) : (m_stream.avail_out == 0) );
+  m_iZlibNs += timer.nsecsElapsed();
+
+  if ( bFinish )
+  {
+    m_bEnd = (iRes == Z_STREAM_END);
+    return m_bEnd;
+  }
+  return iRes == Z_OK || iRes == Z_BUF_ERROR;
+}
+
+//===============================================================================
+// FtpChecksum
+//===============================================================================
+FtpChecksum::FtpChecksum( Algorithm algorithm )
+  : m_algorithm(algorithm), m_crc(crc32( 0L, Z_NULL, 0 )), m_sha(QCryptographicHash::Sha256),
+    m_iSize(0), m_iElapsedNs(0)
+{
+}
+
+const char* FtpChecksum::name() const
+{
+  return (m_algorithm == Crc32) ? "CRC32" : "SHA-256";
+}
+
+void FtpChecksum::add( const char* data, int len )
+{
+  QElapsedTimer timer;
+  timer.start();
+  // zlib picks the fastest CRC32 code for the CPU it runs on
+  if ( m_algorithm == Crc32 )
+    m_crc = crc32( m_crc, reinterpret_cast<const Bytef*>( data ), len );
+  else
+    m_sha.addData( data, len );
+  m_iSize += len;
+  m_iElapsedNs += timer.nsecsElapsed();
+}
+
+bool FtpChecksum::addFile( int fd, KIO::fileoffset_t len )
+{
+  QByteArray buffer( 1024 * 1024, '\0' );
+  KIO::fileoffset_t pos = 0;
+  while ( pos < len )
+  {
+    ssize_t n = pread( fd, buffer.data(), qMin<KIO::fileoffset_t>( buffer.size(), len - pos ), pos );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n <= 0 )
+      return false;
+    add( buffer.constData(), n );
+    pos += n;
+  }
+  return true;
+}
+
+QByteArray FtpChecksum::result() const
+{
+  if ( m_algorithm == Crc32 )
+    return QByteArray::number( qulonglong(m_crc), 16 ).rightJustified( 8, '0' );
+  return m_sha.result().toHex();
+}
@@ -23,12 +23,23 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
-
+#include <zlib.h>
 
 #include <QtCore/QByteRef>
 
 #include <kio/slavebase.h>
 
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QCache>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+#include <QtCore/QWaitCondition>
+
 #include <QtNetwork/QSslSocket>
 #include <QtNetwork/QTcpServer>
 
@@ -38,6 +49,7 @@ struct FtpEntry
   QString owner;
   QString group;
   QString link;
+  QByteArray unique;            // MLSx "unique" fact, identifies the file on the server
 
   KIO::filesize_t size;
   mode_t type;
@@ -45,6 +57,25 @@ struct FtpEntry
   time_t date;
 };
 
+/**
+ * A parsed directory listing as kept by the listing cache, see Ftp::listDir()
+ */
+struct FtpListing
+{
+  QList<FtpEntry> entries;
+  qint64 time;                  // when it was read, msecs since the epoch
+};
+
+/**
+ * A byte range of a segmented download, see Ftp::ftpGetSegmented()
+ */
+struct FtpSegment
+{
+  KIO::fileoffset_t start;
+  KIO::fileoffset_t end;
+  KIO::filesize_t done;
+};
+
 class SslServer : public QTcpServer
 {
   private: 
@@ -54,6 +85,304 @@ class SslServer : public QTcpServer
     QSslSocket *socket() { return m_socket; };
 };
 
+//===============================================================================
+// FtpSession
+//===============================================================================
+/**
+ * A secondary control connection with its own data connection. It is used
+ * by helper threads that need more connections to the server than the one
+ * Ftp holds, e.g. the segmented download in Ftp::ftpGetSegmented(). It only
+ * knows the commands those helpers need and never talks to the user, the
+ * login information must be known in advance.
+ *
+ * All methods block. A FtpSession must only be used by the thread that
+ * created it.
+ */
+class FtpSession
+{
+public:
+  struct Params
+  {
+    QString host;
+    int port;
+    QString user;
+    QString pass;
+    bool ignoreSslErrors;
+    bool protectData;            // PROT P for data connections
+    bool preferEpsv;             // try EPSV before PASV
+    int connectTimeout;          // milliseconds
+    int readTimeout;             // milliseconds
+    QByteArray sessionTicket;    // TLS session to resume, may be empty
+  };
+
+  explicit FtpSession( const Params& params );
+  ~FtpSession();
+
+  /**
+   * Connect, secure the control connection and log in.
+   * @return true on success, see error() otherwise
+   */
+  bool open();
+
+  /**
+   * Send QUIT and drop both connections
+   */
+  void close();
+
+  /**
+   * Send a command and read its response
+   * @return true if any response was received
+   */
+  bool sendCmd( const QByteArray& cmd );
+
+  /**
+   * The last response with @p iOffset chars skipped, see Ftp::ftpResponse()
+   */
+  const char* response( int iOffset ) const;
+  int respCode() const { return m_iRespCode; }
+  int respType() const { return m_iRespCode / 100; }
+
+  /**
+   * Open a passive data connection and start @p cmd on it, after a REST
+   * if @p offset is not 0.
+   * @return true on success, see error() otherwise
+   */
+  bool openData( const QByteArray& cmd, KIO::fileoffset_t offset = 0 );
+  QSslSocket* data() const { return m_data; }
+
+  /**
+   * Close the data connection after the transfer and read the result
+   * @return true if the server confirmed the transfer
+   */
+  bool closeData();
+
+  /**
+   * Stop a running transfer with ABOR and close the data connection
+   */
+  void abortData();
+
+  /**
+   * the KIO error code of the last failure
+   */
+  int error() const { return m_iError; }
+
+private:
+  bool readResponse( int timeout );
+
+  Params m_params;
+  QSslSocket *m_control;
+  QSslSocket *m_data;
+  QByteArray m_lastLine;
+  int m_iRespCode;
+  int m_iError;
+  bool m_bBusy;
+};
+
+/**
+ * Fetches one FtpSegment of a file over its own FtpSession and writes it
+ * to the shared local file, see Ftp::ftpGetSegmented()
+ */
+class FtpSegmentThread : public QThread
+{
+public:
+  /**
+   * @param path     the encoded path of the remote file
+   * @param fileSize the size of the whole file
+   * @param fd       the local file, written with pwrite()
+   */
+  FtpSegmentThread( const FtpSession::Params& params, const QByteArray& path,
+                    KIO::filesize_t fileSize, int fd, const FtpSegment& segment );
+
+  /**
+   * bytes of the segment that are in the local file
+   */
+  KIO::filesize_t done() const { return m_done.load(); }
+
+  /**
+   * true if the thread failed before it transferred anything, e.g. because
+   * the server has no more connections to spare
+   */
+  bool failedEarly() const { return m_bFailedEarly; }
+
+  /**
+   * the KIO error code, 0 on success
+   */
+  int error() const { return m_iError; }
+  bool clientError() const { return m_bClientError; }
+
+  /**
+   * Ask the thread to stop at the next occasion
+   */
+  void stop() { m_bStop.store(1); }
+
+protected:
+  virtual void run();
+
+private:
+  FtpSession::Params m_params;
+  QByteArray m_path;
+  KIO::filesize_t m_fileSize;
+  int m_fd;
+  FtpSegment m_segment;
+  QAtomicInteger<qint64> m_done;
+  QAtomicInt m_bStop;
+  int m_iError;
+  bool m_bClientError;
+  bool m_bFailedEarly;
+};
+
+/**
+ * Writes a download to the local file in its own thread, so that a slow
+ * disk does not stall the data connection and a slow network does not
+ * leave the disk idle. The data goes through a bounded ring of buffers,
+ * write() blocks while all of them wait for the disk.
+ */
+class FtpFileWriter : public QThread
+{
+public:
+  FtpFileWriter( int fd, int iBufferSize, int iBufferCount );
+
+  /**
+   * Flushes and ends the thread
+   */
+  ~FtpFileWriter();
+
+  /**
+   * Queue @p len bytes for the file
+   * @return 0 or the ERR_xxxx code of an earlier write that failed
+   */
+  int write( const char* buf, int len );
+
+  /**
+   * Wait until everything queued is in the file
+   * @return 0 or the ERR_xxxx code of a write that failed
+   */
+  int flush();
+
+protected:
+  virtual void run();
+
+private:
+  void queueHead();
+
+  int m_fd;
+  int m_iBufferSize;
+  QVector<char*> m_buffers;
+  QVector<int> m_used;
+  int m_iHead;                  // filled by write()
+  int m_iTail;                  // next one for the disk
+  int m_iQueued;                // buffers waiting for the disk
+  int m_iError;
+  bool m_bQuit;
+  QMutex m_mutex;
+  QWaitCondition m_changed;
+};
+
+/**
+ * The zlib stream of a data connection in "MODE Z", see Ftp::ftpOpenCommand().
+ * Downloads and listings are inflated as they are read, uploads deflated
+ * before they are written.
+ */
+class FtpZStream
+{
+public:
+  explicit FtpZStream( bool bDeflate );
+  ~FtpZStream();
+
+  bool isValid() const { return m_bValid; }
+
+  /**
+   * Queue compressed data for inflate()
+   */
+  void feed( const QByteArray& data );
+  bool needsInput() const { return m_iInputPos >= m_input.size(); }
+
+  /**
+   * true once the end of the compressed stream was inflated
+   */
+  bool atEnd() const { return m_bEnd; }
+
+  /**
+   * Inflate what was fed into at most @p len bytes at @p buf
+   * @return the number of bytes, -1 if the data is corrupt
+   */
+  int inflate( char* buf, int len );
+
+  /**
+   * Deflate @p data and append the result to @p out, @p bFinish ends
+   * the stream
+   */
+  bool deflate( const QByteArray& data, QByteArray& out, bool bFinish = false );
+
+  /**
+   * compressed and uncompressed bytes so far, the time zlib took and the
+   * time since the stream was set up
+   */
+  qint64 compressedSize() const { return m_bDeflate ? m_stream.total_out : m_stream.total_in; }
+  qint64 plainSize() const { return m_bDeflate ? m_stream.total_in : m_stream.total_out; }
+  qint64 zlibUs() const { return m_iZlibNs / 1000; }
+  qint64 elapsedUs() const { return m_started.nsecsElapsed() / 1000; }
+
+private:
+  z_stream m_stream;
+  QByteArray m_input;
+  int m_iInputPos;
+  bool m_bDeflate;
+  bool m_bValid;
+  bool m_bEnd;
+  qint64 m_iZlibNs;
+  QElapsedTimer m_started;
+};
+
+/**
+ * Checksum of a transfer, computed while the data goes through and compared
+ * with the one of the server afterwards, see Ftp::ftpVerifyChecksum()
+ */
+class FtpChecksum
+{
+public:
+  typedef enum {
+    None,
+    Crc32,
+    Sha256
+  } Algorithm;
+
+  explicit FtpChecksum( Algorithm algorithm );
+
+  Algorithm algorithm() const { return m_algorithm; }
+
+  /**
+   * the name used by the HASH command, e.g. "SHA-256"
+   */
+  const char* name() const;
+
+  void add( const char* data, int len );
+
+  /**
+   * Add the first @p len bytes of file @p fd, e.g. the part that was there
+   * before a resume. The file position is left alone.
+   */
+  bool addFile( int fd, KIO::fileoffset_t len );
+
+  /**
+   * the checksum in lower case hex digits
+   */
+  QByteArray result() const;
+
+  /**
+   * bytes added so far and the time it took
+   */
+  qint64 size() const { return m_iSize; }
+  qint64 elapsedUs() const { return m_iElapsedNs / 1000; }
+
+private:
+  Algorithm m_algorithm;
+  uLong m_crc;
+  QCryptographicHash m_sha;
+  qint64 m_iSize;
+  qint64 m_iElapsedNs;
+};
+
 //===============================================================================
 // Ftp
 //===============================================================================
@@ -90,7 +419,11 @@ public:
 
   virtual void get( const QUrl& url );
   virtual void put( const QUrl& url, int permissions, KIO::JobFlags flags );
-  //virtual void mimetype( const QUrl& url );
+
+  /**
+   * Reads only the start of the file and stops the transfer then
+   */
+  virtual void mimetype( const QUrl& url );
 
   virtual void slave_status();
 
@@ -108,6 +441,20 @@ private:
   // ------------------------------------------------------------------------
 
   QSslSocket* convertToSslSocket(QTcpSocket *tcpsocket);
+
+  /**
+   * Queue "PBSZ 0" and "PROT P", see ftpQueueCmd(). The responses are
+   * evaluated by requestDataEncryption().
+   */
+  void ftpQueueDataEncryption();
+
+  /**
+   * Evaluate the PBSZ/PROT responses of the last batch and record the
+   * result in m_dataProtection. Falls back to "PROT C" if the server does
+   * not accept a protected data channel.
+   *
+   * @return true if the data channel must be encrypted
+   */
   bool requestDataEncryption();
   int encryptDataChannel();
 
@@ -121,6 +468,35 @@ private:
     statusServerError
   } StatusCode;
 
+  /**
+   * Response to a command that went out through the command queue,
+   * see ftpQueueCmd()
+   */
+  struct FtpResponse
+  {
+    QByteArray cmd;
+    int code;
+    QByteArray line;
+  };
+
+  /**
+   * Per host state that is kept on disk between slave processes, see
+   * ftpLoadHostCache(). Everything in here is what a fresh slave would
+   * otherwise have to find out again after connecting. The TLS session
+   * ticket is only kept in memory, for the endpoint of @p ticketFile.
+   */
+  struct HostCache
+  {
+    QByteArray sessionTicket;
+    QString ticketFile;
+    int extControl;
+    QByteArray syst;
+    QString initialPath;
+    int dataConnMode;
+    int dataProtection;
+    int statProbe;
+  };
+
   /**
    * Login Mode for ftpOpenConnection
    */
@@ -142,6 +518,31 @@ private:
    */
   bool ftpOpenConnection (LoginMode loginMode);
 
+  /**
+   * Returns the file that holds the host cache for the server the control
+   * connection goes to, m_host and m_port or the proxy.
+   */
+  QString ftpHostCacheFile() const;
+
+  /**
+   * Returns the group of ftpHostCacheFile() for m_user, and for m_host
+   * and m_port behind a proxy
+   */
+  QString ftpHostCacheGroup() const;
+
+  /**
+   * Read the host cache for the current host and user into m_hostCache.
+   * Entries older than the "CapabilityCacheTTL" config entry (seconds,
+   * 0 disables the cache) are ignored.
+   */
+  void ftpLoadHostCache();
+
+  /**
+   * Write the current session state to the host cache, see ftpLoadHostCache().
+   * The file is only written when a value changed.
+   */
+  void ftpSaveHostCache();
+
   /**
    * Executes any auto login macro's as specified in a .netrc file.
    */
@@ -167,6 +568,42 @@ private:
    */
   bool ftpSendCmd( const QByteArray& cmd, int maxretries = 1 );
 
+  /**
+   * Queue @p cmd to be sent together with the next ftpSendCmd() or
+   * ftpFlushCmdQueue(). Queued commands must not depend on each others
+   * responses. They are written back to back and their responses are
+   * matched in order, so a whole batch costs a single round trip. Servers
+   * that choke on pipelined commands get them one at a time instead.
+   *
+   * The first command queued after a flush starts a new batch and drops
+   * the responses of the previous one.
+   */
+  void ftpQueueCmd( const QByteArray& cmd );
+
+  /**
+   * Send all queued commands and read their responses. The response of
+   * the last one is the current response afterwards.
+   *
+   * return true if any response received, false on error
+   */
+  bool ftpFlushCmdQueue();
+
+  /**
+   * Make the response to a command of the last batch the current one,
+   * so that m_iRespCode, m_iRespType and ftpResponse(iOffset >= 0) refer
+   * to it. @p cmd is either the full command or its first word(s).
+   *
+   * @return false if the command was not part of the last batch or did
+   *         not get any response
+   */
+  bool ftpUseResponse( const QByteArray& cmd );
+
+  /**
+   * Helper for ftpSendCmd and ftpFlushCmdQueue, appends the current
+   * response to m_queueResponses
+   */
+  void ftpRecordResponse( const QByteArray& cmd );
+
   /**
    * Use the SIZE command to get the file size.
    * @param mode the size depends on the transfer mode, hence this arg.
@@ -175,6 +612,13 @@ private:
    */
   bool ftpSize( const QString & path, char mode );
 
+  /**
+   * Evaluate the response to a queued "SIZE" command @p cmd, see ftpSize().
+   * @return true on success
+   * Gets the size into m_size.
+   */
+  bool ftpSizeResponse( const QByteArray& cmd );
+
   /**
    * Set the current working directory, but only if not yet current
    */
@@ -188,11 +632,17 @@ private:
    *
    * @param mode is 'A' or 'I'. 'A' means ASCII transfer, 'I' means binary transfer.
    * @param errorcode the command-dependent error code to emit on error
+   * @param bCompress transfer in "MODE Z" if the server can, m_zData is
+   *        set up then
+   * @param bRestart the transfer goes on where an earlier one of the same
+   *        job stopped, canResume() isn't emitted again. A refused REST
+   *        isn't reported with error() then but sets m_bRestRefused.
    *
    * @return true if the command was accepted by the server.
    */
   bool ftpOpenCommand( const char *command, const QString & path, char mode,
-                       int errorcode, KIO::fileoffset_t offset = 0 );
+                       int errorcode, KIO::fileoffset_t offset = 0, bool bCompress = false,
+                       bool bRestart = false );
 
   /**
    * The counterpart to openCommand.
@@ -207,10 +657,91 @@ private:
    *
    * Use 'A' to select ASCII and 'I' to select BINARY mode.  If
    * cMode is '?' the m_bTextMode flag is used to choose a mode.
+   *
+   * If @p bQueue is true the TYPE command is only queued, see ftpQueueCmd(),
+   * and m_cDataMode gets updated once its response has been read.
+   *
+   * @return false if TYPE failed, with @p bQueue whether TYPE was queued:
+   *         only then is there a response to look at with ftpUseResponse(),
+   *         otherwise it could be the one of an earlier batch
+   */
+  bool ftpDataMode(char cMode, bool bQueue = false);
+
+  /**
+   * Queue "MODE Z" or "MODE S" if required, see m_bModeZ. "MODE Z" is only
+   * sent to servers that announce it in FEAT.
+   */
+  void ftpTransferMode(bool bCompress);
+
+  /**
+   * Whether a transfer of @p path should be compressed, see the
+   * "CompressedTransfers" config entry and m_noCompress. An empty path
+   * stands for a listing.
+   */
+  bool ftpWantCompression(const QString& path);
+
+  /**
+   * Checks once enough went through m_zData whether compression pays for
+   * the transfer of @p path. If it doesn't, the type of file is not
+   * compressed again in this session.
+   * @return false if the rest should go uncompressed
    */
-  bool ftpDataMode(char cMode);
+  bool ftpKeepCompressing(const QString& path);
 
-  //void ftpAbortTransfer();
+  /**
+   * The checksum to verify transfers with, see the "VerifyTransfers" config
+   * entry. FtpChecksum::None if not wanted or the server has none we know.
+   */
+  FtpChecksum::Algorithm ftpChecksumAlgorithm();
+
+  /**
+   * Ask the server for the checksum of @p path with HASH, XCRC or XSHA256
+   * @return false if it has none
+   */
+  bool ftpRemoteChecksum( const QString& path, FtpChecksum::Algorithm algorithm, QByteArray& sum );
+
+  /**
+   * Compare @p checksum with the server's one for @p path. Both go to the
+   * "checksum" and "checksum-server" metadata.
+   * @return false if they differ
+   */
+  bool ftpVerifyChecksum( const FtpChecksum& checksum, const QString& path );
+
+  /**
+   * Checks before resuming a transfer of @p path at @p offset whether the
+   * partial file still belongs to the complete one: it must not be longer
+   * than the other side (SIZE), and the range right before @p offset must
+   * hold the same bytes on both sides. If it doesn't, ever larger ranges
+   * further back are compared until one matches, see the "VerifyResume"
+   * config entry.
+   * @param fd the local file, the complete one if @p bUpload
+   * @return the offset to resume at, 0 to start over
+   */
+  KIO::fileoffset_t ftpVerifyResume( const QString& path, int fd, KIO::fileoffset_t offset,
+                                     bool bUpload );
+
+  /**
+   * Send @p cmd and wait for its response as long as it takes, for commands
+   * the server answers only once it went through a whole file. Queued
+   * commands (see ftpQueueCmd()) are sent first.
+   * @return false if the job was killed or the connection lost meanwhile
+   */
+  bool ftpSendLongCmd( const QByteArray& cmd );
+
+  /**
+   * Read and inflate at most @p len bytes of the data connection
+   * @return the number of bytes, 0 at the end of the stream, -1 on error
+   */
+  int ftpInflateData(char* buf, int len);
+
+  /**
+   * Stop the transfer started by ftpOpenCommand() with ABOR, the
+   * counterpart to ftpCloseCommand() for a transfer that isn't over.
+   * The session stays as it is, with its directory, TYPE and PROT.
+   * @return false if the server didn't answer and the control connection
+   *         had to go too
+   */
+  bool ftpAbortTransfer();
 
   /**
    * Used by ftpOpenCommand, return 0 on success or an error code
@@ -222,6 +753,10 @@ private:
    */
   void ftpCloseDataConnection();
 
+  /**
+   * Helper for ftpOpenDataConnection, records the mode that worked
+   */
+  int ftpDataConnectionOpened(int iMode);
   /**
    * Helper for ftpOpenDataConnection
    */
@@ -250,17 +785,150 @@ private:
   bool ftpChmod( const QString & path, int permissions );
 
   // used by listDir
-  bool ftpOpenDir( const QString & path );
+  /**
+   * Starts the listing of @p path for ftpReadDir(). With @p details 0
+   * (see stat()) only names and types are asked for if the server can do
+   * that, see m_bMlstFactsReduced and m_bNlst.
+   */
+  bool ftpOpenDir( const QString & path, int details = 2 );
+
+  /**
+   * List directory @p path with "STAT -la" on the control connection,
+   * which saves the data connection and its TLS handshake. Only done with
+   * the "ListOverControl" config entry. Directories with more than
+   * "ListOverControlMaxEntries" entries are listed with LIST next time.
+   *
+   * @return false if the server can't do it, @p entries is empty then
+   */
+  bool ftpListOverControl( const QString& path, QList<FtpEntry>& entries );
+
+  /**
+   * Parses a line of a listing that ftpResponse() reads on the control
+   * connection and appends it to m_pStreamEntries
+   */
+  void ftpStreamListingLine( QByteArray& line, int iCode );
   /**
     * Called to parse directory listings, call this until it returns false
     */
   bool ftpReadDir(FtpEntry& ftpEnt);
 
+  /**
+   * Parses one line of a LIST listing, see ftpReadDir(). @p buffer is
+   * modified. With @p bFullPath names may be paths, only their last part
+   * is kept.
+   * @return false if the line is not an entry
+   */
+  bool ftpParseDirLine(char* buffer, FtpEntry& ftpEnt, bool bFullPath = false);
+
+  /**
+   * Prepare ftpParseDirLine() for the lines of a new listing, everything
+   * that is the same for all of them is worked out here once
+   */
+  void ftpStartListing();
+
+  /**
+   * Decode @p len chars of a listing. Plain ASCII skips the codec if the
+   * remote encoding leaves it as it is.
+   */
+  QString ftpDecodeListing( const char* p, int len );
+
+  /**
+   * ftpDecodeListing() for owners, groups and link targets, which repeat
+   * a lot. Each distinct byte string is decoded once and all entries
+   * share the resulting QString, see m_listStrings.
+   */
+  QString ftpInternListing( const char* p, int len );
+
+  /**
+   * Fills @p ftpEnt from a line of a MLSD listing or of a MLST response,
+   * "fact=value;fact=value; name" (RFC 3659)
+   * @return false if the line can't be used
+   */
+  bool ftpParseMlsx(const QByteArray& line, FtpEntry& ftpEnt);
+
+  /**
+   * Evaluates the response to FEAT, called from ftpRecordResponse()
+   */
+  void ftpParseFeatures();
+
+  /**
+   * Queue "OPTS MLST" to get the server's default facts back after a
+   * listing that only asked for the type, see ftpOpenDir()
+   */
+  void ftpRestoreMlstFacts();
+
+  /**
+   * Fills @p ftpEnt from a line of a NLST listing, @p line is modified
+   * @return false if the line can't be used
+   */
+  bool ftpParseNlst( char* line, FtpEntry& ftpEnt );
+
+  /**
+   * stat() for servers that know MLST, answers with a single command
+   * @return false if the server didn't answer, stat() has to find out
+   *         another way then
+   */
+  bool ftpStatMlst( const QString& path, const QString& filename, int details );
+
+  /**
+   * stat() with SIZE and MDTM sent together. Files get size and date,
+   * directories are found with CWD.
+   * @return see ftpStatMlst()
+   */
+  bool ftpStatSizeMdtm( const QString& path, const QString& filename, int details );
+
+  /**
+   * stat() with STAT <path>, which has the server list the file on the
+   * control connection
+   * @return see ftpStatMlst()
+   */
+  bool ftpStatStat( const QString& path, const QString& filename, int details );
+
+  /**
+   * Remember @p iProbe as the way to stat() on this server
+   */
+  void ftpStatProbeWorked( int iProbe );
+
+  /**
+   * The cached listing of directory @p path, or 0 if there is none younger
+   * than the "ListingCacheTTL" config entry (seconds, 0 disables the cache).
+   * Counts the hits and misses reported by slave_status().
+   */
+  FtpListing* ftpCachedListing( const QString& path );
+
+  /**
+   * Keep @p entries as the listing of directory @p path. The cache holds at
+   * most "ListingCacheSize" KiB, the oldest listings are dropped first.
+   */
+  void ftpCacheListing( const QString& path, const QList<FtpEntry>& entries );
+
+  /**
+   * Forget what the listing cache knows about @p path, i.e. the listing of
+   * its parent. With @p bSubtree also the listings of @p path and below.
+   */
+  void ftpInvalidateListing( const QString& path, bool bSubtree );
+
+  /**
+   * stat() from the cached listing of the parent directory
+   * @return false if there is none or @p filename is not in it
+   */
+  bool ftpStatCached( const QString& path, const QString& filename, int details );
+
   /**
     * Helper to fill an UDSEntry
     */
   void ftpCreateUDSEntry( const QString & filename, FtpEntry& ftpEnt, KIO::UDSEntry& entry, bool isDir );
 
+  /**
+   * listDir() helpers: ftpListEntry() collects the entries and hands them
+   * to listEntries() in batches, either when ftpFlushListEntries() is
+   * called or when the batch is full or 200 ms old. Batches start small and
+   * grow, so the first entries show up quickly.
+   */
+  void ftpStartListEntries();
+  void ftpListEntry( FtpEntry& ftpEnt, bool bNamesOnly = false );
+  void ftpFlushListEntries();
+
   void ftpShortStatAnswer( const QString& filename, bool isDir );
 
   void ftpStatAnswerNotFound( const QString & path, const QString & filename );
@@ -303,9 +971,11 @@ private:
    * @param iError      set to an ERR_xxxx code on error
    * @param iCopyFile   -1 -or- handle of a local destination file
    * @param hCopyOffset local file only: non-zero for resume
+   * @param bRestart    see ftpOpenCommand()
    * @return 0 for success, -1 for server error, -2 for client error
    */
-  StatusCode ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fileoffset_t hCopyOffset);
+  StatusCode ftpGet(int& iError, int iCopyFile, const QUrl& url, KIO::fileoffset_t hCopyOffset,
+                    bool bRestart = false);
 
   /**
    * This is the internal implementation of put() - see copy().
@@ -319,6 +989,28 @@ private:
    */
   StatusCode ftpPut(int& iError, int iCopyFile, const QUrl& url, int permissions, KIO::JobFlags flags);
 
+  /**
+   * true if copies may move file data between the data connection and the
+   * local file in the kernel, see ftpSpliceToFile() and ftpSendFile(). This
+   * needs the "ZeroCopyTransfers" config entry and a data connection
+   * without TLS.
+   */
+  bool ftpZeroCopy();
+
+  /**
+   * helper for ftpGet(): moves the rest of the download to @p iCopyFile
+   * with splice(), the data never gets copied to user space.
+   * @return 0 at the end of the file, an ERR_xxxx code on error or -1 if
+   *         the kernel can't do this here and nothing was moved
+   */
+  int ftpSpliceToFile(int iCopyFile, KIO::fileoffset_t& processed_size, KIO::filesize_t& bytesLeft);
+
+  /**
+   * helper for ftpPut(): sends the rest of @p iCopyFile with sendfile()
+   * @return see ftpSpliceToFile()
+   */
+  int ftpSendFile(int iCopyFile, KIO::fileoffset_t& processed_size);
+
   /**
    * helper called from copy() to implement FILE -> FTP transfers
    *
@@ -339,12 +1031,69 @@ private:
    */
   StatusCode ftpCopyGet(int& iError, int& iCopyFile, const QString &sCopyFile, const QUrl& url, int permissions, KIO::JobFlags flags);
 
+  /**
+   * helper called from copy() for FTP -> FTP copies on the server we are
+   * logged in to, with SITE CPFR and SITE CPTO (ProFTPD's mod_copy). The
+   * data never leaves the server.
+   *
+   * @param iError      set to an ERR_xxxx code on error,
+   *                    ERR_UNSUPPORTED_ACTION if the server doesn't know
+   *                    SITE CPFR
+   * @param permissions applied with SITE CHMOD afterwards, -1 for none
+   * @return 0 for success, -1 for server error, -2 for client error
+   */
+  StatusCode ftpCopyServerSide(int& iError, const QUrl& src, const QUrl& dest,
+                               int permissions, KIO::JobFlags flags);
+
+  /**
+   * helper called from ftpCopyGet() for files above the
+   * "SegmentedDownloadThreshold" config entry. The file is split into
+   * ranges that are fetched in parallel, each over its own connection
+   * (see FtpSegmentThread). Progress is kept in @p sStateFile so that each
+   * range can be resumed on its own. Without a valid state file the
+   * download starts over, nothing tells where the holes of the file are.
+   * If the server has no connection to spare at all, the rest comes over
+   * the one of Ftp as a single stream.
+   *
+   * @param iError      set to an ERR_xxxx code on error
+   * @param iCopyFile   handle of the local destination file
+   * @param sStateFile  file holding the progress of the segments
+   * @return 0 for success, -1 for server error, -2 for client error
+   */
+  StatusCode ftpGetSegmented(int& iError, int iCopyFile, const QUrl& url,
+                             const QString& sStateFile);
+
+  /**
+   * Read the segment progress written by ftpGetSegmented()
+   * @return false if there is no usable state for a file of @p size bytes
+   */
+  static bool ftpLoadSegments(const QString& sStateFile, KIO::filesize_t size,
+                              QList<FtpSegment>& segments);
+  static void ftpSaveSegments(const QString& sStateFile, KIO::filesize_t size,
+                              const QList<FtpSegment>& segments);
+
+  /**
+   * @return how many bytes from the start of the file @p segments hold
+   *         without a hole
+   */
+  static KIO::fileoffset_t ftpSegmentsHead(const QList<FtpSegment>& segments);
+
+  /**
+   * Parameters for a FtpSession to the current host
+   */
+  FtpSession::Params ftpSessionParams();
+
 private: // data members
 
   QString m_host;
   int m_port;
   QString m_user;
   QString m_pass;
+  /**
+   * the login information that worked, see ftpLogin()
+   */
+  QString m_loginUser;
+  QString m_loginPass;
   /**
    * Where we end up after connecting
    */
@@ -372,6 +1121,11 @@ private: // data members
    */
   char m_cDataMode;
 
+  /**
+   * true while the server is in "MODE Z", maintained like m_cDataMode
+   */
+  bool m_bModeZ;
+
   /**
    * true if logged on (m_control should also be non-NULL)
    */
@@ -389,12 +1143,22 @@ private: // data members
    * When the user cancels a get or put command the Ftp dtor will be called,
    * which in turn calls closeConnection(). The later would try to send QUIT
    * which won't work until timeout. ftpOpenCommand sets the m_bBusy flag so
-   * that the sockets will be closed immedeately - the server should be
-   * capable of handling this and return an error code on thru the control
-   * connection. The m_bBusy gets cleared by the ftpCloseCommand() routine.
+   * that the transfer gets stopped with ftpAbortTransfer() first. The
+   * m_bBusy gets cleared by the ftpCloseCommand() routine.
    */
   bool m_bBusy;
 
+  /**
+   * true after an ABOR that got a single 226, the server may still send
+   * the second reply, see ftpAbortTransfer() and ftpResponse()
+   */
+  bool m_bAbortReplyPending;
+
+  /**
+   * the server refused the REST of a restarted transfer, see ftpOpenCommand()
+   */
+  bool m_bRestRefused;
+
   bool m_bPasv;
   bool m_bUseProxy;
 
@@ -408,22 +1172,181 @@ private: // data members
     eprtUnknown = 0x04,
     epsvAllSent = 0x10,
     pasvUnknown = 0x20,
-    chmodUnknown = 0x100
+    chmodUnknown = 0x100,
+    featKnown = 0x200,          // FEAT was answered, see ftpParseFeatures()
+    mlstSupported = 0x400,      // MLST and MLSD (RFC 3659)
+    statListUnknown = 0x800,    // STAT can't list a directory, see ftpListOverControl()
+    siteCopyUnknown = 0x1000,   // no SITE CPFR/CPTO, see ftpCopyServerSide()
+    modeZSupported = 0x2000,    // "MODE Z" in FEAT, see ftpTransferMode()
+    hashCrc32 = 0x4000,         // HASH (draft-bryan-ftpext-hash) knows CRC32
+    hashSha256 = 0x8000,        // ... and SHA-256
+    xcrcSupported = 0x10000,    // XCRC in FEAT
+    xsha256Supported = 0x20000  // XSHA256 in FEAT
   };
   int m_extControl;
 
+  /**
+   * Data channel protection level, see requestDataEncryption(). RFC 4217
+   * makes PROT part of the session state, so it is negotiated once after
+   * login and only again after a reconnect.
+   */
+  enum
+  {
+    protUnknown = 0,
+    protPrivate,
+    protClear
+  };
+  int m_dataProtection;
+
+  /**
+   * The kind of data connection that worked last, tried first by
+   * ftpOpenDataConnection()
+   */
+  enum
+  {
+    dataConnUnknown = 0,
+    dataConnPasv,
+    dataConnEpsv,
+    dataConnPort
+  };
+  int m_dataConnMode;
+
+  /**
+   * The way to stat() that worked last on this server, tried first. The
+   * others follow in this order if it fails, statProbeList is never kept.
+   */
+  enum
+  {
+    statProbeUnknown = 0,
+    statProbeMlst,              // MLST <path>, see ftpStatMlst()
+    statProbeSizeMdtm,          // SIZE and MDTM <path>, see ftpStatSizeMdtm()
+    statProbeStat,              // STAT <path>, see ftpStatStat()
+    statProbeList               // CWD <parent> and LIST <name> on a data connection
+  };
+  int m_statProbe;
+
+  /**
+   * the answer to SYST, see ftpLogin()
+   */
+  QByteArray m_syst;
+
+  /**
+   * state loaded from the host cache, see ftpLoadHostCache()
+   */
+  HostCache m_hostCache;
+
   /**
    * control connection socket, only set if openControl() succeeded
    */
   QSslSocket *m_control;
   QByteArray m_lastControlLine;
+  /**
+   * all lines but the last one of a multi-line response, see ftpResponse()
+   */
+  QList<QByteArray> m_responseLines;
+  /**
+   * where ftpResponse() puts the lines of a listing, see ftpListOverControl()
+   */
+  QList<FtpEntry>* m_pStreamEntries;
+
+  /**
+   * true while ftpReadDir() reads a MLSD listing
+   */
+  bool m_bMlsd;
+
+  /**
+   * true while ftpReadDir() reads a NLST listing
+   */
+  bool m_bNlst;
+
+  /**
+   * true once the server accepted "OPTS MLST type;", see ftpOpenDir() and
+   * ftpRecordResponse(). m_mlstFacts are the facts the server sends by
+   * default according to FEAT.
+   */
+  bool m_bMlstFactsReduced;
+  QByteArray m_mlstFacts;
+
+  /**
+   * data of the listing that ftpReadDir() didn't parse yet, starting at
+   * m_iDirPos
+   */
+  QByteArray m_dirBuffer;
+  int m_iDirPos;
+
+  /**
+   * set by ftpStartListing(), m_iListYear is 0 until it was called
+   */
+  int m_iListYear;
+  int m_iListMonth;             // 1..12
+  int m_iListUtcOffset;         // seconds, local time - UTC
+  int m_iListOffsetHour;        // the hour m_iListUtcOffset is for
+  bool m_bListAscii;            // the remote encoding keeps ASCII
+
+  /**
+   * decoded owners, groups and link targets of the listings of this
+   * session, see ftpInternListing()
+   */
+  QHash<QByteArray, QString> m_listStrings;
+
+  /**
+   * directories too big for ftpListOverControl()
+   */
+  QSet<QString> m_largeDirs;
+
+  /**
+   * commands waiting to be sent by the next ftpSendCmd(), see ftpQueueCmd()
+   */
+  QList<QByteArray> m_cmdQueue;
+
+  /**
+   * responses to the commands of the last flushed queue, in order
+   */
+  QList<FtpResponse> m_queueResponses;
+
+  /**
+   * set once the server failed to answer pipelined commands, from then on
+   * queued commands are sent one at a time. Survives reconnects.
+   */
+  bool m_bPipelineBroken;
 
   /**
    * data connection socket
    */
   QSslSocket *m_data;
   //QTcpSocket *m_data;
+
+  /**
+   * inflates or deflates m_data in "MODE Z", NULL otherwise
+   */
+  FtpZStream *m_zData;
+
+  /**
+   * suffixes of files that didn't compress in this session, see
+   * ftpKeepCompressing()
+   */
+  QSet<QString> m_noCompress;
   bool m_bIgnoreSslErrors;
+
+  /**
+   * shortest round trip of a command on the control connection in
+   * microseconds, 0 if unknown. ftpGet() sizes its reads with it.
+   */
+  qint64 m_iMinRtt;
+
+  /**
+   * listings read by listDir(), keyed by the clean path, see ftpCachedListing()
+   */
+  QCache<QString, FtpListing> m_listCache;
+  int m_iListCacheHits;
+  int m_iListCacheMisses;
+
+  /**
+   * entries not yet sent by listDir(), see ftpListEntry()
+   */
+  KIO::UDSEntryList m_listBatch;
+  int m_iListBatchLimit;
+  QElapsedTimer m_listBatchTimer;
 };
 
 #endif // KDELIBS_FTP_H